@@ -2,11 +2,25 @@
 
 #include <err.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
 
 
 #ifndef MIN
@@ -14,404 +28,3653 @@
 #endif
 
 
+#ifndef MAX
+#define MAX(a, b) ((a) > (b)) ? (a) : (b)
+#endif
+
+
+/* The writer is published by the producer and tail by the consumer, both
+   with release/acquire atomics, which keeps one producer and one consumer
+   safe to run concurrently, across processes for MRB_SHARED buffers. */
 struct mrb {
     unsigned char *buff;
     size_t size;
     int writer;
     int reader;
+    int flags;
+
+    /* The backing file of MRB_FILE buffers, -1 otherwise. */
+    int fd;
+
+    /* Absolute byte positions of the writer and the reader, and the oldest
+       byte retained for mrb_read_at(), the writer never overwrites data from
+       tail onwards. Without retention tail follows the reader. */
+    uint64_t wseq;
+    uint64_t rseq;
+    uint64_t tseq;
+    int tail;
+    bool retain;
+
+    /* Bytes (and records) written after the writer but not visible to the
+       reader yet, see mrb_txbegin(). */
+    size_t pending;
+    uint64_t msgpending;
+    bool tx;
+
+    /* Incremental CRC32C of the data put since mrb_crc32c_track(). */
+    bool crctrack;
+    uint32_t crc;
+
+    /* Record sequence numbers and the optional record index, the absolute
+       position of record seq lives in index[seq % indexsize]. */
+    uint64_t msgwrite;
+    uint64_t msgread;
+    uint64_t *index;
+    size_t indexsize;
+    uint64_t indexhead;
+
+    /* Adaptive mrb_readin() state, see mrb_readin_policy(): the current
+       read size and the moving average (out of 256) of extra reads that
+       found nothing. */
+    int rdpolicy;
+    size_t rdsize;
+    unsigned int rdmiss;
+
+    /* MSG_ZEROCOPY sends in flight, see mrb_zerocopy_enable(). */
+    struct mrb_zerocopy *zc;
+
+    /* Fill level watermarks, see mrb_watermark(). */
+    struct mrb_watermark *wm;
+
+    /* MRB_PRIVATE buffers, copied for the child after fork(2). */
+    struct mrb *forkprev;
+    struct mrb *forknext;
+
+    /* The number of fork(2) calls before this buffer was created. */
+    uint64_t forkepoch;
+
+    /* The arena the buffer is carved from, see mrb_arena_alloc(). */
+    struct mrb_arena *arena;
 };
 
 
-int
-mrb_validatesize(size_t size) {
-    int pagesize = getpagesize();
-
-    /* Calculate the real size (multiple of pagesize). */
-    if (size % pagesize) {
-        warn(
-            "Invalid size: %lu, size should be multiple of pagesize (%d), "
-            "see getpagesize(2).",
-            size,
-            pagesize
-        );
-        return -1;
-    }
+/* Internal flag of buffers allocated by mrb_create_small(). */
+#define MRB_SMALL 0x10000
 
-    return 0;
-}
 
+/* Rings are carved from a single memfd, the one of offset o is mapped at
+   base + 2 * o, so consecutive rings in the file end up in mergeable
+   mappings. Freed rings stay mapped and go to the free list of their size
+   class, linked through their first bytes. */
+#define MRB_ARENA_CLASSES 32
+struct mrb_arena {
+    unsigned char *base;
+    size_t size;
+    size_t next;
+    int fd;
+    pthread_mutex_t lock;
+    unsigned char *free[MRB_ARENA_CLASSES];
+};
 
-size_t
-mrb_calcsize(unsigned int pages) {
-    int pagesize = getpagesize();
 
-    return pagesize * pages;
-}
+/* Sends are numbered by the kernel, per socket, from zero. */
+#define MRB_ZC_INFLIGHT 64
+struct mrb_zerocopy {
+    uint32_t head;
+    uint32_t next;
+    uint64_t end[MRB_ZC_INFLIGHT];
+    bool done[MRB_ZC_INFLIGHT];
+};
 
 
-int
-mrb_init(struct mrb *b, size_t size) {
-    if (mrb_validatesize(size)) {
-        return -1;
-    }
+/* above flips on crossing, by whichever side crosses first. */
+struct mrb_watermark {
+    size_t high;
+    size_t low;
+    bool above;
+    int busy;
+    mrb_watermark_cb callback;
+    void *arg;
 
-    b->size = size;
-    b->writer = 0;
-    b->reader = 0;
+    /* mrb_watermark_epoll(), -1 otherwise */
+    int epfd;
+    int fd;
+    struct epoll_event event;
+};
 
-    /* Create a temporary file with requested size as the backend for mmap. */
-    FILE *file = tmpfile();
-    const int fd = fileno(file);
-    ftruncate(fd, b->size);
-
-    /* Allocate the underlying backed buffer. */
-    b->buff = mmap(
-            NULL,
-            b->size * 2,
-            PROT_NONE,
-            MAP_ANONYMOUS | MAP_PRIVATE,
-            -1,
-            0
-        );
-    if (b->buff == MAP_FAILED) {
-        close(fd);
-        fclose(file);
-        return -1;
-    }
 
-    unsigned char *first = mmap(
-            b->buff,
-            b->size,
-            PROT_READ | PROT_WRITE,
-            MAP_FIXED | MAP_SHARED,
-            fd,
-            0
-        );
+static pthread_mutex_t _forklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _forkonce = PTHREAD_ONCE_INIT;
+static struct mrb *_forkrings;
+static uint64_t _forkepoch;
 
-    if (first == MAP_FAILED) {
-        munmap(b->buff, b->size * 2);
-        close(fd);
-        fclose(file);
-        return -1;
-    }
 
-    unsigned char *second = mmap(
-            b->buff + b->size,
-            b->size,
-            PROT_READ | PROT_WRITE,
-            MAP_FIXED | MAP_SHARED,
-            fd,
-            0
-        );
+/* Mirrors of destroyed buffers, reused by mrb_initex() so short lived
+   buffers skip the system calls. Only buffers of this process that never
+   went through fork(2) are cached, the other process might still map them.
+   Above MRB_CACHE_KEEPSIZE their pages are handed back to the kernel on the
+   way in and only the mappings are kept, smaller ones keep their pages (up
+   to 1 MiB in all) as dropping them costs more than mapping anew. Up to
+   _cachemax of them (see mrb_cache_limit()), protected by _forklock. */
+#define MRB_CACHE_MAXSIZE (1 << 20)
+#define MRB_CACHE_KEEPSIZE (1 << 16)
+static struct {
+    unsigned char *buff;
+    size_t size;
+} _cache[MRB_CACHE_MAX];
+static int _cachecount;
+static int _cachemax = MRB_CACHE_MAX;
 
-    if (second == MAP_FAILED) {
-        munmap(b->buff, b->size * 2);
-        close(fd);
-        fclose(file);
-        return -1;
-    }
 
-    fclose(file);
-    return 0;
-}
+static uint32_t _crc32c_table[8][256];
+static pthread_once_t _crc32conce = PTHREAD_ONCE_INIT;
+static int _crc32c_hw;
 
 
-struct mrb *
-mrb_create(size_t size) {
-    struct mrb *b;
+static void
+_crc32c_init(void) {
+    uint32_t crc;
+    int i;
+    int j;
 
-    /* Allocate memory for mrb structure. */
-    b = malloc(sizeof(struct mrb));
-    if (b == NULL) {
-        return NULL;
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+        _crc32c_table[0][i] = crc;
     }
 
-    if (mrb_init(b, size)) {
-        free(b);
-        return NULL;
+    for (i = 0; i < 256; i++) {
+        crc = _crc32c_table[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = _crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            _crc32c_table[j][i] = crc;
+        }
     }
 
-    return b;
+#if defined(__x86_64__) || defined(__i386__)
+    _crc32c_hw = __builtin_cpu_supports("sse4.2");
+#else
+    _crc32c_hw = 0;
+#endif
 }
 
 
-int
-mrb_deinit(struct mrb *b) {
-    /* unmap second part */
-    if (munmap(b->buff + b->size, b->size)) {
-        return -1;
+/* Slicing-by-8 fallback, processes 8 bytes per iteration. */
+static uint32_t
+_crc32c_sw(uint32_t crc, const unsigned char *p, size_t size) {
+    uint64_t word;
+
+    while (size && ((uintptr_t)p & 7)) {
+        crc = _crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        size--;
     }
 
-    /* unmap first part */
-    if (munmap(b->buff, b->size)) {
-        return -1;
+    while (size >= 8) {
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = _crc32c_table[7][word & 0xff] ^
+            _crc32c_table[6][(word >> 8) & 0xff] ^
+            _crc32c_table[5][(word >> 16) & 0xff] ^
+            _crc32c_table[4][(word >> 24) & 0xff] ^
+            _crc32c_table[3][(word >> 32) & 0xff] ^
+            _crc32c_table[2][(word >> 40) & 0xff] ^
+            _crc32c_table[1][(word >> 48) & 0xff] ^
+            _crc32c_table[0][word >> 56];
+        p += 8;
+        size -= 8;
     }
 
-    /* unmap backed buffer */
-    if (munmap(b->buff, b->size * 2)) {
-        return -1;
+    while (size--) {
+        crc = _crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
     }
-    return 0;
+
+    return crc;
 }
 
 
-int
-mrb_destroy(struct mrb *b) {
-    if (mrb_deinit(b)) {
-        return -1;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static uint32_t
+_crc32c_hwupdate(uint32_t crc, const unsigned char *p, size_t size) {
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    uint64_t word;
+
+    while (size >= 8) {
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        size -= 8;
     }
-    free(b);
-    return 0;
-}
+    crc = (uint32_t)crc64;
+#endif
 
+    while (size--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
 
-/** Obtain the total buffer capacity of a VRB.
- */
-size_t
-mrb_size(struct mrb *b) {
-    return b->size;
+    return crc;
 }
+#endif
 
 
-/** Obtain the length of empty space in the buffer.
+/** Update a CRC32C (Castagnoli) checksum with size bytes from data, start
+  with crc = 0. Uses the SSE4.2 crc32 instruction when the CPU supports it.
  */
-size_t
-mrb_available(struct mrb *b) {
-    // 11000111
-    //   w  r
-    if (b->writer < b->reader) {
-        return b->reader - b->writer - 1;
+uint32_t
+mrb_crc32c_update(uint32_t crc, const void *data, size_t size) {
+    pthread_once(&_crc32conce, _crc32c_init);
+
+    crc = ~crc;
+#if defined(__x86_64__) || defined(__i386__)
+    if (_crc32c_hw) {
+        return ~_crc32c_hwupdate(crc, data, size);
     }
-
-    // 00111100
-    //   r   w
-    return b->size - (b->writer - b->reader) - 1;
+#endif
+    return ~_crc32c_sw(crc, data, size);
 }
 
 
-/** Obtain the length of data in the buffer.
- */
-size_t
-mrb_used(struct mrb *b) {
-    // 00111000
-    //   r  w
-    if (b->writer >= b->reader) {
-        return b->writer - b->reader;
-    }
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+#define XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
 
-    // 11000111
-    //   w  r
-    return b->size - (b->reader - b->writer);
+
+static inline uint64_t
+_xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    acc = XXH_ROTL(acc, 31);
+    return acc * XXH_PRIME1;
 }
 
 
-/** Determine if the buffer is currently empty.
- */
-bool
-mrb_isempty(struct mrb *b) {
-    return b->reader == b->writer;
+static inline uint64_t
+_xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= _xxh64_round(0, val);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
 }
 
 
-/** Determine if the buffer is currently full.
- */
-bool
-mrb_isfull(struct mrb *b) {
-    return b->size == (mrb_used(b) + 1);
+static inline uint64_t
+_xxh64_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
 }
 
 
-/** Copy data from a caller location to the magic ring buffer.
- */
-size_t
-mrb_put(struct mrb *b, const char *restrict source, size_t size) {
-    size_t amount = MIN(size, mrb_available(b));
-    memcpy(b->buff + b->writer, source, amount);
-    b->writer = (b->writer + amount) % b->size;
-    return amount;
+static inline uint32_t
+_xxh64_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
 }
 
 
-/** Copy data to the magic ring buffer only if all of it will fit.
+/** xxHash64 of size bytes from data.
  */
-int
-mrb_putall(struct mrb *b, const char *restrict source, size_t size) {
-    if (size > mrb_available(b)) {
-        return -1;
+uint64_t
+mrb_xxh64(const void *data, size_t size, uint64_t seed) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        uint64_t v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+        uint64_t v2 = seed + XXH_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME1;
+
+        do {
+            v1 = _xxh64_round(v1, _xxh64_read64(p));
+            v2 = _xxh64_round(v2, _xxh64_read64(p + 8));
+            v3 = _xxh64_round(v3, _xxh64_read64(p + 16));
+            v4 = _xxh64_round(v4, _xxh64_read64(p + 24));
+            p += 32;
+        } while (p <= end - 32);
+
+        h = XXH_ROTL(v1, 1) + XXH_ROTL(v2, 7) + XXH_ROTL(v3, 12) +
+            XXH_ROTL(v4, 18);
+        h = _xxh64_merge(h, v1);
+        h = _xxh64_merge(h, v2);
+        h = _xxh64_merge(h, v3);
+        h = _xxh64_merge(h, v4);
+    }
+    else {
+        h = seed + XXH_PRIME5;
     }
-    memcpy(b->buff + b->writer, source, size);
-    b->writer = (b->writer + size) % b->size;
-    return 0;
-}
 
+    h += size;
 
-/** Copy data from the magic ring buffer to a caller location.
- */
-size_t
-mrb_get(struct mrb *b, char *dest, size_t size) {
-    size_t amount = MIN(size, mrb_used(b));
-    memcpy(dest, b->buff + b->reader, amount);
-    b->reader = (b->reader + amount) % b->size;
-    return amount;
-}
+    while (p + 8 <= end) {
+        h ^= _xxh64_round(0, _xxh64_read64(p));
+        h = XXH_ROTL(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+        p += 8;
+    }
 
+    if (p + 4 <= end) {
+        h ^= (uint64_t)_xxh64_read32(p) * XXH_PRIME1;
+        h = XXH_ROTL(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
 
-/** Copy data from the magic ring buffer to a caller location without
-  modifying the buffer state.
- */
-size_t
-mrb_softget(struct mrb *b, char *dest, size_t size, size_t offset) {
-    size_t amount = MIN(size + offset, mrb_used(b));
-    memcpy(dest, b->buff + b->reader + offset, amount - offset);
-    return amount - offset;
+    while (p < end) {
+        h ^= (*p++) * XXH_PRIME5;
+        h = XXH_ROTL(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
 }
 
 
-/** Tail drop
-  */
-int
-mrb_skip(struct mrb *b, size_t size) {
-    if (mrb_used(b) < size) {
-        return -1;
+/* Buffers mapped without the mirror (MRB_NOMIRROR) wrap at the end of the
+   buffer, so every access to their data has to be split there. With the
+   mirror any offset below twice the size is fine as is. */
+static inline unsigned char *
+_at(struct mrb *b, size_t offset) {
+    if (b->flags & MRB_NOMIRROR) {
+        return b->buff + (offset % b->size);
     }
-    b->reader = (b->reader + size) % b->size;
-    return 0;
+    return b->buff + offset;
 }
 
 
-/** Rollback reader
-  */
-int
-mrb_rollback(struct mrb *b, size_t size) {
-    if (mrb_used(b) > size) {
-        return -1;
+/* How much of size bytes at offset is contiguous in memory. */
+static inline size_t
+_span(struct mrb *b, size_t offset, size_t size) {
+    size_t end;
+
+    if (b->flags & MRB_NOMIRROR) {
+        end = b->size - (offset % b->size);
+        return MIN(size, end);
     }
-    b->reader = (b->reader - size) % b->size;
-    return 0;
+    return size;
 }
 
 
-/** Get data from a magic ring buffer and copy it to the space provider by
-  the caller only if the minimum specified amount can be copied. If less data
-  than the minimum is available, then no data is copied.
- */
-ssize_t
-mrb_getmin(struct mrb *b, char *dest, size_t minsize, size_t maxsize) {
-    size_t used = mrb_used(b);
-    if (minsize > used) {
-        return -1;
+static inline void
+_copyin(struct mrb *b, size_t offset, const void *source, size_t size) {
+    size_t first = _span(b, offset, size);
+
+    memcpy(_at(b, offset), source, first);
+    if (first < size) {
+        memcpy(b->buff, (const unsigned char *)source + first, size - first);
     }
-    size_t amount = MIN(maxsize, used);
-    memcpy(dest, b->buff + b->reader, amount);
-    b->reader = (b->reader + amount) % b->size;
-    return amount;
 }
 
 
-/** read(2) data into a magic ring buffer until EOF or full, or I/O would
-  block.
- */
-ssize_t
-mrb_readin(struct mrb *b, int fd, size_t size) {
-    size_t amount = MIN(size, mrb_available(b));
-    ssize_t res = read(fd, b->buff + b->writer, amount);
-    if (res > 0) {
-        b->writer = (b->writer + res) % b->size;
+static inline void
+_copyout(struct mrb *b, void *dest, size_t offset, size_t size) {
+    size_t first = _span(b, offset, size);
+
+    memcpy(dest, _at(b, offset), first);
+    if (first < size) {
+        memcpy((unsigned char *)dest + first, b->buff, size - first);
     }
-    return res;
 }
 
 
-/** Print formatted string into buffer
-  */
-int
-mrb_print(struct mrb *b, const char *format, ...) {
-    va_list args;
+/* Describe size bytes at offset with one iovec, or two when they wrap. */
+static inline int
+_iov(struct mrb *b, size_t offset, size_t size, struct iovec *iov) {
+    size_t first = _span(b, offset, size);
 
-    if (format) {
-        va_start(args, format);
+    iov[0].iov_base = _at(b, offset);
+    iov[0].iov_len = first;
+    if (first == size) {
+        return 1;
     }
 
-    int written = mrb_vprint(b, format, args);
+    iov[1].iov_base = b->buff;
+    iov[1].iov_len = size - first;
+    return 2;
+}
 
-    if (format) {
-        va_end(args);
-    }
 
-    return written;
+/* memmove() towards the reader, to is before from. */
+static void
+_move(struct mrb *b, size_t to, size_t from, size_t size) {
+    size_t amount;
+
+    while (size) {
+        amount = _span(b, to, size);
+        amount = _span(b, from, amount);
+        memmove(_at(b, to), _at(b, from), amount);
+        to += amount;
+        from += amount;
+        size -= amount;
+    }
 }
 
 
-/** Print formatted string into buffer
-  */
-int
-mrb_vprint(struct mrb *b, const char *format, va_list args) {
-    int written = vsnprintf(b->buff + b->writer, mrb_available(b), format,
-            args);
+/* Where the next byte is written, past any uncommitted data. */
+static inline size_t
+_woffset(struct mrb *b) {
+    return b->writer + b->pending;
+}
 
-    if (written > 0) {
-        b->writer = (b->writer + written) % b->size;
-    }
 
-    return written;
+static inline unsigned char *
+_wptr(struct mrb *b) {
+    return _at(b, _woffset(b));
 }
 
 
-/** write(2) data from a magic ring buffer until empty, or I/O would block.
- */
-ssize_t
-mrb_writeout(struct mrb *b, int fd, size_t size) {
-    size_t amount = MIN(size, mrb_used(b));
-    ssize_t res = write(fd, b->buff + b->reader, amount);
-    if (res > 0) {
-        b->reader = (b->reader + res) % b->size;
+static void
+_watermark_epoll(struct mrb_watermark *wm, bool above) {
+    struct epoll_event event = wm->event;
+
+    if (above) {
+        event.events &= ~EPOLLIN;
     }
-    return res;
+    else {
+        event.events |= EPOLLIN;
+    }
+    epoll_ctl(wm->epfd, EPOLL_CTL_MOD, wm->fd, &event);
 }
 
 
-/** Search for the specified string within buffer
-
+/* Fill level for the watermarks, from whichever side checks them: only
+   the published writer and tail count, loaded as the other side stores
+   them, pending data of the producer is not there yet. */
+static inline size_t
+_watermark_level(struct mrb *b) {
+    int writer = __atomic_load_n(&b->writer, __ATOMIC_ACQUIRE);
+    int tail = __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE);
 
-  limit argument will be ignored if it's value is 0 or greater than data available
-  in the buffer.
+    if (writer >= tail) {
+        return writer - tail;
+    }
+    return b->size - (tail - writer);
+}
 
-  if start is greater than data available in the buffer, then -1 is returned,
-  and errno set to indicate the error. <- TODO
 
-  Return: Index of the first occurance or -1 if not found.
-  */
-ssize_t
-mrb_search(struct mrb *b, const char *needle, size_t needlelen, size_t start,
-        ssize_t limit) {
+/* Tell about a crossing of the watermarks. The producer and the consumer
+   (or a signal handler) may both get here, only one of them runs the
+   transitions and the others just bump busy to have it check again, so
+   the transitions and their effects happen in order and the last one
+   matches the buffer. A lock would deadlock against a signal handler. */
+static void
+_watermark_check(struct mrb *b) {
+    struct mrb_watermark *wm = b->wm;
+    int one = 1;
+    size_t level;
+    bool above;
+
+    if (__atomic_fetch_add(&wm->busy, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
 
-    size_t used;
-    unsigned char *s;
-    unsigned char *found;
-    if ((needle == NULL) || (needlelen == 0)) {
-        return -1;
+    for (;;) {
+        level = _watermark_level(b);
+        above = wm->above;
+        if (level >= wm->high) {
+            above = true;
+        }
+        else if (level <= wm->low) {
+            above = false;
+        }
+
+        if (above != wm->above) {
+            wm->above = above;
+            if (wm->epfd >= 0) {
+                _watermark_epoll(wm, above);
+            }
+            else {
+                wm->callback(b, above, wm->arg);
+            }
+        }
+
+        /* Done, unless somebody else checked meanwhile */
+        if (__atomic_compare_exchange_n(&wm->busy, &one, 0, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        one = 1;
+        __atomic_store_n(&wm->busy, 1, __ATOMIC_RELEASE);
     }
+}
 
-    used = mrb_used(b);
-    if ((start < 0) || (start >= used)) {
-        errno = EINVAL;
-        return -1;
+
+/* Make everything written so far visible to the reader. The data is
+   ordered before the writer so neither the consumer nor a signal handler
+   ever sees it half written. */
+static inline void
+_publish(struct mrb *b) {
+    size_t first;
+
+    if (b->crctrack) {
+        first = _span(b, b->writer, b->pending);
+        b->crc = mrb_crc32c_update(b->crc, b->buff + b->writer, first);
+        b->crc = mrb_crc32c_update(b->crc, b->buff, b->pending - first);
     }
+    __atomic_store_n(&b->writer, (b->writer + b->pending) % b->size,
+            __ATOMIC_RELEASE);
+    b->wseq += b->pending;
+    b->msgwrite += b->msgpending;
+    b->pending = 0;
+    b->msgpending = 0;
+    if (b->wm) {
+        _watermark_check(b);
+    }
+}
 
-    if (limit <= 0) {
-        limit = used;
+
+static inline void
+_writer_advance(struct mrb *b, size_t amount) {
+    b->pending += amount;
+    if (!b->tx) {
+        _publish(b);
     }
-    else {
-        limit = MIN(limit, used);
+}
+
+
+/* Hand space back to the producer, once everything before it is read. */
+static inline void
+_tail_set(struct mrb *b, int tail, uint64_t tseq) {
+    b->tseq = tseq;
+    __atomic_store_n(&b->tail, tail, __ATOMIC_RELEASE);
+    if (b->wm) {
+        _watermark_check(b);
     }
+}
 
-    s = b->buff + b->reader;
-    s += start;
 
-    found = memmem(s, limit, needle, needlelen);
-    if (found == NULL) {
-        return -1;
+static inline void
+_reader_advance(struct mrb *b, size_t amount) {
+    b->reader = (b->reader + amount) % b->size;
+    b->rseq += amount;
+    if (!b->retain) {
+        _tail_set(b, b->reader, b->rseq);
     }
+}
 
-    return found - (b->buff + b->reader);
+
+int
+mrb_validatesize(size_t size) {
+    int pagesize = getpagesize();
+
+    /* Calculate the real size (multiple of pagesize). */
+    if (size % pagesize) {
+        warn(
+            "Invalid size: %lu, size should be multiple of pagesize (%d), "
+            "see getpagesize(2).",
+            size,
+            pagesize
+        );
+        return -1;
+    }
+
+    return 0;
+}
+
+
+size_t
+mrb_calcsize(unsigned int pages) {
+    int pagesize = getpagesize();
+
+    return pagesize * pages;
+}
+
+
+/* Give the child of fork(2) its own copy of every MRB_PRIVATE buffer, by
+   mapping a fresh backing file with the same content over the shared one
+   at the same address. */
+static void
+_fork_child(void) {
+    struct mrb *b;
+    int fd;
+
+    for (b = _forkrings; b; b = b->forknext) {
+        fd = memfd_create("mrb", MFD_CLOEXEC);
+        if (fd < 0) {
+            warn("Cannot copy mrb for the child process");
+            continue;
+        }
+
+        if ((pwrite(fd, b->buff, b->size, 0) != (ssize_t)b->size) ||
+                (mmap(b->buff, b->size, PROT_READ | PROT_WRITE,
+                      MAP_FIXED | MAP_SHARED, fd, 0) == MAP_FAILED) ||
+                (mmap(b->buff + b->size, b->size, PROT_READ | PROT_WRITE,
+                      MAP_FIXED | MAP_SHARED, fd, 0) == MAP_FAILED)) {
+            warn("Cannot copy mrb for the child process");
+        }
+        else if (b->fd >= 0) {
+            dup3(fd, b->fd, O_CLOEXEC);
+        }
+        close(fd);
+    }
+
+    /* The parent reuses those */
+    while (_cachecount) {
+        _cachecount--;
+        munmap(_cache[_cachecount].buff, _cache[_cachecount].size * 2);
+    }
+
+    _forkepoch++;
+    pthread_mutex_unlock(&_forklock);
+}
+
+
+static void
+_fork_prepare(void) {
+    pthread_mutex_lock(&_forklock);
+}
+
+
+static void
+_fork_parent(void) {
+    _forkepoch++;
+    pthread_mutex_unlock(&_forklock);
+}
+
+
+static void
+_fork_register(void) {
+    pthread_atfork(_fork_prepare, _fork_parent, _fork_child);
+}
+
+
+/** Keep up to count mirrors of destroyed buffers (at most MRB_CACHE_MAX,
+  the default) for reuse, 0 turns the cache off. Cached mirrors beyond
+  count are unmapped right away.
+
+  Return: 0 on success, -1 with errno set to EINVAL if count is too large.
+  */
+int
+mrb_cache_limit(unsigned int count) {
+    if (count > MRB_CACHE_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&_forklock);
+    __atomic_store_n(&_cachemax, count, __ATOMIC_RELAXED);
+    while (_cachecount > _cachemax) {
+        _cachecount--;
+        munmap(_cache[0].buff, _cache[0].size * 2);
+        memmove(_cache, _cache + 1, _cachecount * sizeof(_cache[0]));
+    }
+    pthread_mutex_unlock(&_forklock);
+    return 0;
+}
+
+
+/* Map the buffer twice in a row with two system calls: one shared mapping
+   of twice the size, then mremap(2) with old_size 0 maps the pages of the
+   first half again over the second. Only MRB_FILE needs a memfd, others
+   use anonymous shared memory. A single munmap(2) tears all of it down. On
+   failure nothing is left behind and errno is that of the failing call. */
+static int
+_map_mirror(struct mrb *b) {
+    unsigned char *buff = MAP_FAILED;
+    int fd = -1;
+    int err;
+    int i;
+
+    if (!(b->flags & (MRB_FILE | MRB_SHARED))) {
+        pthread_mutex_lock(&_forklock);
+        for (i = _cachecount - 1; i >= 0; i--) {
+            if (_cache[i].size == b->size) {
+                b->buff = _cache[i].buff;
+                _cache[i] = _cache[--_cachecount];
+                pthread_mutex_unlock(&_forklock);
+                return 0;
+            }
+        }
+        pthread_mutex_unlock(&_forklock);
+    }
+
+    if (b->flags & MRB_FILE) {
+        fd = memfd_create("mrb", MFD_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+
+        if (ftruncate(fd, b->size)) {
+            goto failed;
+        }
+    }
+
+    buff = mmap(NULL, b->size * 2, PROT_READ | PROT_WRITE,
+            MAP_SHARED | ((fd < 0)? MAP_ANONYMOUS: 0), fd, 0);
+    if (buff == MAP_FAILED) {
+        goto failed;
+    }
+
+    if (mremap(buff, 0, b->size, MREMAP_MAYMOVE | MREMAP_FIXED,
+                buff + b->size) == MAP_FAILED) {
+        goto failed;
+    }
+
+    /* MRB_FILE keeps the memfd as the backing file */
+    b->fd = fd;
+    b->buff = buff;
+    return 0;
+
+failed:
+    err = errno;
+    if (buff != MAP_FAILED) {
+        munmap(buff, b->size * 2);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    errno = err;
+    return -1;
+}
+
+
+/* A single anonymous mapping, for when the mirror can not be set up (some
+   sandboxes refuse MAP_FIXED or file backed shared mappings). A private
+   mapping gives MRB_PRIVATE its copy on fork(2) for free. */
+static int
+_map_flat(struct mrb *b) {
+    int share = (b->flags & MRB_PRIVATE)? MAP_PRIVATE: MAP_SHARED;
+
+    b->buff = mmap(NULL, b->size, PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | share, -1, 0);
+    if (b->buff == MAP_FAILED) {
+        return -1;
+    }
+
+    b->flags |= MRB_NOMIRROR;
+    return 0;
+}
+
+
+/* Everything but the mapping. */
+static void
+_reset(struct mrb *b, size_t size, int flags) {
+    b->size = size;
+    b->flags = flags;
+    b->fd = -1;
+    b->forkprev = NULL;
+    b->forknext = NULL;
+    b->writer = 0;
+    b->reader = 0;
+    b->wseq = 0;
+    b->rseq = 0;
+    b->tseq = 0;
+    b->tail = 0;
+    b->retain = false;
+    b->pending = 0;
+    b->msgpending = 0;
+    b->tx = false;
+    b->crctrack = false;
+    b->crc = 0;
+    b->msgwrite = 0;
+    b->msgread = 0;
+    b->index = NULL;
+    b->indexsize = 0;
+    b->indexhead = 0;
+    b->zc = NULL;
+    b->wm = NULL;
+    b->rdpolicy = MRB_READIN_FIXED;
+    b->rdsize = 0;
+    b->rdmiss = 0;
+    b->forkepoch = __atomic_load_n(&_forkepoch, __ATOMIC_RELAXED);
+    b->arena = NULL;
+}
+
+
+int
+mrb_init(struct mrb *b, size_t size) {
+    return mrb_initex(b, size, 0);
+}
+
+
+/** Initialize a buffer with explicit fork(2) semantics:
+
+  MRB_SHARED    The buffer and its state are shared with child processes,
+                one producer and one consumer may live in different
+                processes. b itself must live in shared memory, as
+                mrb_createex() arranges.
+  MRB_PRIVATE   The child gets a private copy of the buffer as it was at
+                the time of fork(2).
+
+  MRB_FILE keeps the backing file open, which lets mrb_sendout() hand data
+  to the kernel without copying it through user space.
+
+  Without either flag the data is shared but the state is not, and only
+  one of the processes may use the buffer after fork(2).
+
+  MRB_NOMIRROR maps the buffer once instead of twice in a row, this is also
+  what happens when the mirror can not be mapped, see mrb_ismirrored().
+  The API stays the same, but data is copied in two parts where it wraps,
+  mrb_peek() and mrb_reserve() only reach up to the end of the buffer and
+  there is no backing file for MRB_FILE.
+  */
+int
+mrb_initex(struct mrb *b, size_t size, int flags) {
+    if (mrb_validatesize(size)) {
+        return -1;
+    }
+
+    if ((flags & MRB_SHARED) && (flags & MRB_PRIVATE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _reset(b, size, flags);
+
+    /* The mirror cache depends on the fork(2) handlers */
+    pthread_once(&_forkonce, _fork_register);
+
+    if ((flags & MRB_NOMIRROR) || _map_mirror(b)) {
+        if (_map_flat(b)) {
+            return -1;
+        }
+    }
+
+    if ((flags & MRB_PRIVATE) && !(b->flags & MRB_NOMIRROR)) {
+        pthread_mutex_lock(&_forklock);
+        b->forknext = _forkrings;
+        if (_forkrings) {
+            _forkrings->forkprev = b;
+        }
+        _forkrings = b;
+        pthread_mutex_unlock(&_forklock);
+    }
+
+    return 0;
+}
+
+
+struct mrb *
+mrb_create(size_t size) {
+    return mrb_createex(size, 0);
+}
+
+
+/** Allocate and initialize a buffer, see mrb_initex() for flags. The
+  structure of a MRB_SHARED buffer is allocated in shared memory.
+  */
+struct mrb *
+mrb_createex(size_t size, int flags) {
+    struct mrb *b;
+
+    /* Allocate memory for mrb structure. */
+    int err;
+
+    if (flags & MRB_SHARED) {
+        b = mmap(NULL, sizeof(struct mrb), PROT_READ | PROT_WRITE,
+                MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+        if (b == MAP_FAILED) {
+            return NULL;
+        }
+    }
+    else {
+        b = malloc(sizeof(struct mrb));
+        if (b == NULL) {
+            return NULL;
+        }
+    }
+
+    if (mrb_initex(b, size, flags)) {
+        err = errno;
+        if (flags & MRB_SHARED) {
+            munmap(b, sizeof(struct mrb));
+        }
+        else {
+            free(b);
+        }
+        errno = err;
+        return NULL;
+    }
+
+    return b;
+}
+
+
+/* Put the ring of b on the free list of its size class. */
+static void
+_arena_release(struct mrb *b) {
+    struct mrb_arena *a = b->arena;
+    int class = __builtin_ctzl(b->size / getpagesize());
+
+    pthread_mutex_lock(&a->lock);
+    memcpy(b->buff, &a->free[class], sizeof(unsigned char *));
+    a->free[class] = b->buff;
+    pthread_mutex_unlock(&a->lock);
+}
+
+
+int
+mrb_deinit(struct mrb *b) {
+    unsigned char *buff;
+    size_t size;
+
+    free(b->index);
+    b->index = NULL;
+    free(b->zc);
+    b->zc = NULL;
+    free(b->wm);
+    b->wm = NULL;
+
+    if (b->fd >= 0) {
+        close(b->fd);
+        b->fd = -1;
+    }
+
+    if ((b->flags & MRB_PRIVATE) && !(b->flags & MRB_NOMIRROR)) {
+        pthread_mutex_lock(&_forklock);
+        if (b->forkprev) {
+            b->forkprev->forknext = b->forknext;
+        }
+        else {
+            _forkrings = b->forknext;
+        }
+        if (b->forknext) {
+            b->forknext->forkprev = b->forkprev;
+        }
+        pthread_mutex_unlock(&_forklock);
+    }
+
+    if (b->arena) {
+        _arena_release(b);
+        b->buff = NULL;
+        return 0;
+    }
+
+    /* Freed along with b */
+    if (b->flags & MRB_SMALL) {
+        return 0;
+    }
+
+    if (!(b->flags & (MRB_NOMIRROR | MRB_FILE | MRB_SHARED)) &&
+            (b->size <= MRB_CACHE_MAXSIZE) &&
+            __atomic_load_n(&_cachemax, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&_forklock);
+        /* Large ones cached without their pages, MADV_REMOVE rather than
+           MADV_FREE as the mirror is shared memory. Only once it is sure
+           to be cached: from before a fork the pages are shared with the
+           child, which may well still use them. */
+        if ((b->forkepoch == _forkepoch) && _cachemax &&
+                ((b->size <= MRB_CACHE_KEEPSIZE) ||
+                 (madvise(b->buff, b->size, MADV_REMOVE) == 0))) {
+            /* Full, the oldest one makes room */
+            buff = NULL;
+            if (_cachecount == _cachemax) {
+                buff = _cache[0].buff;
+                size = _cache[0].size;
+                _cachecount--;
+                memmove(_cache, _cache + 1, _cachecount * sizeof(_cache[0]));
+            }
+            _cache[_cachecount].buff = b->buff;
+            _cache[_cachecount].size = b->size;
+            _cachecount++;
+            pthread_mutex_unlock(&_forklock);
+            b->buff = NULL;
+            if (buff) {
+                return munmap(buff, size * 2);
+            }
+            return 0;
+        }
+        pthread_mutex_unlock(&_forklock);
+    }
+
+    /* Both halves of the mirror at once */
+    if (munmap(b->buff, (b->flags & MRB_NOMIRROR)? b->size: b->size * 2)) {
+        return -1;
+    }
+    b->buff = NULL;
+    return 0;
+}
+
+
+int
+mrb_destroy(struct mrb *b) {
+    bool shared = b->flags & MRB_SHARED;
+
+    if (mrb_deinit(b)) {
+        return -1;
+    }
+
+    if (shared) {
+        munmap(b, sizeof(struct mrb));
+    }
+    else {
+        free(b);
+    }
+    return 0;
+}
+
+
+/** Allocate a small buffer of any size (at least 2 bytes) in ordinary heap
+  memory, the structure and the data in a single allocation, so tiny
+  buffers cost neither mappings nor page granularity. Small buffers have
+  no mirror (see MRB_NOMIRROR) and no flags, and are not suitable for
+  O_DIRECT. Free with mrb_destroy().
+  */
+struct mrb *
+mrb_create_small(size_t size) {
+    struct mrb *b;
+
+    if ((size < 2) || (size > INT32_MAX)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    b = malloc(sizeof(struct mrb) + size);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    _reset(b, size, MRB_NOMIRROR | MRB_SMALL);
+    b->buff = (unsigned char *)(b + 1);
+    return b;
+}
+
+
+/** Reserve address space for rings with a total capacity of size bytes
+  (a multiple of the page size) backed by a single memfd, rings are then
+  carved from it with mrb_arena_alloc(). Each ring costs no file
+  descriptor of its own and the mappings of neighbouring rings merge.
+  */
+struct mrb_arena *
+mrb_arena_create(size_t size) {
+    struct mrb_arena *a;
+    int err;
+
+    if (mrb_validatesize(size)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    a = calloc(1, sizeof(struct mrb_arena));
+    if (a == NULL) {
+        return NULL;
+    }
+
+    a->size = size;
+    a->fd = memfd_create("mrb-arena", MFD_CLOEXEC);
+    if (a->fd < 0) {
+        free(a);
+        return NULL;
+    }
+
+    a->base = MAP_FAILED;
+    if (ftruncate(a->fd, size)) {
+        goto failed;
+    }
+
+    a->base = mmap(NULL, size * 2, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE,
+            -1, 0);
+    if (a->base == MAP_FAILED) {
+        goto failed;
+    }
+
+    pthread_mutex_init(&a->lock, NULL);
+    return a;
+
+failed:
+    err = errno;
+    close(a->fd);
+    free(a);
+    errno = err;
+    return NULL;
+}
+
+
+/** Release the arena with all of its rings at once, every ring allocated
+  from it has to be destroyed first.
+  */
+int
+mrb_arena_destroy(struct mrb_arena *a) {
+    int res = munmap(a->base, a->size * 2);
+
+    close(a->fd);
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+    return res;
+}
+
+
+/** Allocate a ring from the arena, to be freed with mrb_destroy(). The
+  capacity is rounded up to a power of two pages, see mrb_size(). A ring
+  freed earlier is reused without a single system call, a new one costs
+  two mmap(2) calls. Arena rings have no flags, see mrb_initex().
+
+  Return: NULL with errno set to ENOMEM if the arena is exhausted.
+  */
+struct mrb *
+mrb_arena_alloc(struct mrb_arena *a, size_t size) {
+    size_t pagesize = getpagesize();
+    size_t capacity = pagesize;
+    unsigned char *buff;
+    struct mrb *b;
+    int class = 0;
+
+    while (capacity < size) {
+        capacity <<= 1;
+        class++;
+    }
+
+    if (class >= MRB_ARENA_CLASSES) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    b = malloc(sizeof(struct mrb));
+    if (b == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    buff = a->free[class];
+    if (buff) {
+        memcpy(&a->free[class], buff, sizeof(unsigned char *));
+        pthread_mutex_unlock(&a->lock);
+    }
+    else {
+        if (capacity > (a->size - a->next)) {
+            pthread_mutex_unlock(&a->lock);
+            free(b);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        buff = a->base + a->next * 2;
+        if ((mmap(buff, capacity, PROT_READ | PROT_WRITE,
+                    MAP_FIXED | MAP_SHARED, a->fd, a->next) == MAP_FAILED) ||
+                (mmap(buff + capacity, capacity, PROT_READ | PROT_WRITE,
+                      MAP_FIXED | MAP_SHARED, a->fd, a->next) == MAP_FAILED)) {
+            pthread_mutex_unlock(&a->lock);
+            free(b);
+            return NULL;
+        }
+        a->next += capacity;
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    _reset(b, capacity, 0);
+    b->buff = buff;
+    b->arena = a;
+    return b;
+}
+
+
+/** Determine if the buffer is mapped with the mirror, see MRB_NOMIRROR.
+ */
+bool
+mrb_ismirrored(struct mrb *b) {
+    return !(b->flags & MRB_NOMIRROR);
+}
+
+
+/** Obtain the total buffer capacity of a VRB.
+ */
+size_t
+mrb_size(struct mrb *b) {
+    return b->size;
+}
+
+
+/** Obtain the length of empty space in the buffer, retained and
+  uncommitted data is not empty space.
+ */
+size_t
+mrb_available(struct mrb *b) {
+    int tail = __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE);
+
+    // 11000111
+    //   w  t
+    if (b->writer < tail) {
+        return tail - b->writer - 1 - b->pending;
+    }
+
+    // 00111100
+    //   t   w
+    return b->size - (b->writer - tail) - 1 - b->pending;
+}
+
+
+/** Obtain the length of data in the buffer.
+ */
+size_t
+mrb_used(struct mrb *b) {
+    int writer = __atomic_load_n(&b->writer, __ATOMIC_ACQUIRE);
+
+    // 00111000
+    //   r  w
+    if (writer >= b->reader) {
+        return writer - b->reader;
+    }
+
+    // 11000111
+    //   w  r
+    return b->size - (b->reader - writer);
+}
+
+
+/** Determine if the buffer is currently empty.
+ */
+bool
+mrb_isempty(struct mrb *b) {
+    return b->reader == __atomic_load_n(&b->writer, __ATOMIC_ACQUIRE);
+}
+
+
+/** Determine if the buffer is currently full, that is nothing more can be
+  put. Retained and uncommitted data fill it as well.
+ */
+bool
+mrb_isfull(struct mrb *b) {
+    return mrb_available(b) == 0;
+}
+
+
+/** Copy data from a caller location to the magic ring buffer.
+  Async-signal-safe.
+ */
+size_t
+mrb_put(struct mrb *b, const char *restrict source, size_t size) {
+    size_t avail = mrb_available(b);
+    size_t amount = MIN(size, avail);
+    _copyin(b, _woffset(b), source, amount);
+    _writer_advance(b, amount);
+    return amount;
+}
+
+
+/** Copy data to the magic ring buffer only if all of it will fit.
+  Async-signal-safe.
+ */
+int
+mrb_putall(struct mrb *b, const char *restrict source, size_t size) {
+    if (size > mrb_available(b)) {
+        return -1;
+    }
+    _copyin(b, _woffset(b), source, size);
+    _writer_advance(b, size);
+    return 0;
+}
+
+
+/** Copy data from the magic ring buffer to a caller location.
+ */
+size_t
+mrb_get(struct mrb *b, char *dest, size_t size) {
+    size_t used = mrb_used(b);
+    size_t amount = MIN(size, used);
+    _copyout(b, dest, b->reader, amount);
+    _reader_advance(b, amount);
+    return amount;
+}
+
+
+/** Copy data from the magic ring buffer to a caller location without
+  modifying the buffer state.
+ */
+size_t
+mrb_softget(struct mrb *b, char *dest, size_t size, size_t offset) {
+    size_t used = mrb_used(b);
+    size_t amount = MIN(size + offset, used);
+    _copyout(b, dest, b->reader + offset, amount - offset);
+    return amount - offset;
+}
+
+
+/** Tail drop
+  */
+int
+mrb_skip(struct mrb *b, size_t size) {
+    if (mrb_used(b) < size) {
+        return -1;
+    }
+    _reader_advance(b, size);
+    return 0;
+}
+
+
+/** Rollback reader, making the last size consumed bytes readable again.
+
+  With retention enabled (see mrb_retain()) the reader can step back over
+  any retained data, which the writer never overwrites, so a parser can
+  consume speculatively and rewind until it calls mrb_release(). Without
+  retention only data not yet overwritten by the writer can be restored.
+
+  With an index (see mrb_index_enable()) the records stepped back over are
+  counted as unread again, as far back as the index reaches.
+
+  Return: 0 on success, -1 with errno set to ERANGE if the data is not
+  retained, has been overwritten or is older than the index.
+  */
+int
+mrb_rollback(struct mrb *b, size_t size) {
+    uint64_t msgread = b->msgread;
+
+    if (b->retain) {
+        if (size > (b->rseq - b->tseq)) {
+            errno = ERANGE;
+            return -1;
+        }
+    }
+    else if ((size > b->rseq) || (size > mrb_available(b))) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    /* Records starting from the new reader on are unread again. Where
+       the one before the oldest indexed starts is unknown, only the end
+       of it is: the start of the oldest one. */
+    if (b->index && size) {
+        while ((msgread > b->indexhead) &&
+                (b->index[(msgread - 1) % b->indexsize] >= b->rseq - size)) {
+            msgread--;
+        }
+        if (msgread && (msgread <= b->indexhead) &&
+                ((msgread != b->indexhead) || (msgread == b->msgwrite) ||
+                 (b->index[msgread % b->indexsize] != b->rseq - size))) {
+            errno = ERANGE;
+            return -1;
+        }
+    }
+
+    b->reader = (b->reader + b->size - size) % b->size;
+    b->rseq -= size;
+    b->msgread = msgread;
+    if (!b->retain) {
+        _tail_set(b, b->reader, b->rseq);
+    }
+    return 0;
+}
+
+
+/** Obtain a pointer to the data in the buffer without consuming it, size is
+  set to its length. The whole of it is contiguous thanks to the mirror,
+  without it (see MRB_NOMIRROR) only the data up to the end of the buffer
+  is.
+  */
+const char *
+mrb_peek(struct mrb *b, size_t *size) {
+    size_t used = mrb_used(b);
+
+    *size = _span(b, b->reader, used);
+    return (const char *)b->buff + b->reader;
+}
+
+
+/** Get data from a magic ring buffer and copy it to the space provider by
+  the caller only if the minimum specified amount can be copied. If less data
+  than the minimum is available, then no data is copied.
+ */
+ssize_t
+mrb_getmin(struct mrb *b, char *dest, size_t minsize, size_t maxsize) {
+    size_t used = mrb_used(b);
+    if (minsize > used) {
+        return -1;
+    }
+    size_t amount = MIN(maxsize, used);
+    _copyout(b, dest, b->reader, amount);
+    _reader_advance(b, amount);
+    return amount;
+}
+
+
+/* Adaptive read(2) loop, size is only an upper bound here. Reads grow while
+   they come back full and shrink when they come back short. A full read
+   suggests more is pending, so another read is tried, unless such extra
+   reads mostly hit EAGAIN lately. Each extra read skipped for that lowers
+   the miss rate a little, so they are tried again once in a while. */
+static ssize_t
+_readin_adaptive(struct mrb *b, int fd, size_t size) {
+    size_t minsize = getpagesize();
+    size_t total = 0;
+    size_t avail;
+    size_t amount;
+    ssize_t res;
+
+    for (;;) {
+        avail = mrb_available(b);
+        amount = MIN(MIN(size - total, avail), b->rdsize);
+        amount = _span(b, _woffset(b), amount);
+        if (amount == 0) {
+            break;
+        }
+
+        res = read(fd, _wptr(b), amount);
+        if (res <= 0) {
+            if (total == 0) {
+                return res;
+            }
+            if ((res < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+                b->rdmiss += (256 - b->rdmiss) / 8;
+            }
+            break;
+        }
+
+        if (total) {
+            b->rdmiss -= b->rdmiss / 8;
+        }
+        _writer_advance(b, res);
+        total += res;
+
+        if ((size_t)res < amount) {
+            if (((size_t)res < (b->rdsize / 2)) && (b->rdsize > minsize)) {
+                b->rdsize /= 2;
+            }
+            break;
+        }
+
+        if ((amount == b->rdsize) && (b->rdsize < b->size)) {
+            b->rdsize *= 2;
+        }
+
+        if (b->rdmiss > 128) {
+            b->rdmiss -= b->rdmiss / 32;
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+/** read(2) data into a magic ring buffer until EOF or full, or I/O would
+  block. With the adaptive policy (see mrb_readin_policy()) size is only an
+  upper bound.
+ */
+ssize_t
+mrb_readin(struct mrb *b, int fd, size_t size) {
+    if (b->rdpolicy == MRB_READIN_ADAPTIVE) {
+        return _readin_adaptive(b, fd, size);
+    }
+
+    size_t avail = mrb_available(b);
+    size_t amount = MIN(size, avail);
+    ssize_t res = read(fd, _wptr(b), _span(b, _woffset(b), amount));
+    if (res > 0) {
+        _writer_advance(b, res);
+    }
+    return res;
+}
+
+
+/** Choose how mrb_readin() sizes its reads:
+
+  MRB_READIN_FIXED     One read(2) of exactly MIN(size, available).
+  MRB_READIN_ADAPTIVE  Read sizes follow the recent arrival pattern, and
+                       another read(2) is issued in the same call when the
+                       last one came back full, as long as that pays off.
+  */
+int
+mrb_readin_policy(struct mrb *b, int policy) {
+    if ((policy != MRB_READIN_FIXED) && (policy != MRB_READIN_ADAPTIVE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    b->rdpolicy = policy;
+    b->rdsize = getpagesize();
+    b->rdmiss = 0;
+    return 0;
+}
+
+
+/** Print formatted string into buffer
+  */
+int
+mrb_print(struct mrb *b, const char *format, ...) {
+    va_list args;
+
+    if (format) {
+        va_start(args, format);
+    }
+
+    int written = mrb_vprint(b, format, args);
+
+    if (format) {
+        va_end(args);
+    }
+
+    return written;
+}
+
+
+/** Print formatted string into buffer, only if all of it will fit.
+
+  Return: Number of bytes written, or -1 with errno set to ENOBUFS if the
+  output does not fit.
+  */
+int
+mrb_vprint(struct mrb *b, const char *format, va_list args) {
+    size_t avail = mrb_available(b);
+    size_t span = _span(b, _woffset(b), avail);
+    va_list again;
+    char *wrapped;
+
+    va_copy(again, args);
+    int written = vsnprintf((char *)_wptr(b), span, format, args);
+
+    /* Fits, but not before the end of the buffer */
+    if ((written > 0) && ((size_t)written >= span) &&
+            ((size_t)written < avail)) {
+        wrapped = malloc(written + 1);
+        if (wrapped == NULL) {
+            va_end(again);
+            return -1;
+        }
+        vsnprintf(wrapped, written + 1, format, again);
+        _copyin(b, _woffset(b), wrapped, written);
+        free(wrapped);
+        va_end(again);
+        _writer_advance(b, written);
+        return written;
+    }
+    va_end(again);
+
+    if ((written > 0) && ((size_t)written >= avail)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (written > 0) {
+        _writer_advance(b, written);
+    }
+
+    return written;
+}
+
+
+/* fopencookie(3) write function, all or nothing so a short write never
+   leaves half of an fprintf(3) in the buffer. Failure is reported as 0
+   rather than -1, glibc goes on writing garbage after a negative count. */
+static ssize_t
+_cookie_write(void *cookie, const char *source, size_t size) {
+    if (mrb_putall((struct mrb *)cookie, source, size)) {
+        errno = ENOBUFS;
+        return 0;
+    }
+    return size;
+}
+
+
+/* fopencookie(3) read function, an empty buffer reads as end of file. */
+static ssize_t
+_cookie_read(void *cookie, char *dest, size_t size) {
+    return mrb_get((struct mrb *)cookie, dest, size);
+}
+
+
+/** Open a stdio stream on the buffer, so code written against FILE * puts
+  and gets straight into it. mode is as for fopen(3), reads consume from
+  the buffer and writes append to it, the stream is not seekable.
+
+  The stream is unbuffered, each fwrite(3) call copies its output into the
+  buffer once, only if all of it fits. Otherwise nothing is written, the
+  call fails with errno set to ENOBUFS and ferror(3) is set. fprintf(3)
+  behaves the same for up to BUFSIZ (8 KiB with glibc) of output, beyond
+  that stdio hands it over in BUFSIZ pieces, and the pieces that fit stay
+  when a later one does not. To put a longer one all or nothing, wrap it in
+  mrb_txbegin() and mrb_txcommit(), or mrb_txabort() when it fails.
+
+  An empty buffer reads as end of file, use clearerr(3) to read again once
+  more data arrives. fclose(3) leaves the buffer alone.
+  */
+FILE *
+mrb_fopen(struct mrb *b, const char *mode) {
+    cookie_io_functions_t io = {
+        .read = _cookie_read,
+        .write = _cookie_write,
+        .seek = NULL,
+        .close = NULL,
+    };
+    FILE *f = fopencookie(b, mode, io);
+
+    if (f == NULL) {
+        return NULL;
+    }
+
+    setvbuf(f, NULL, _IONBF, 0);
+    return f;
+}
+
+
+/** write(2) data from a magic ring buffer until empty, or I/O would block.
+ */
+ssize_t
+mrb_writeout(struct mrb *b, int fd, size_t size) {
+    size_t used = mrb_used(b);
+    size_t amount = MIN(size, used);
+    struct iovec iov[2];
+    ssize_t res = writev(fd, iov, _iov(b, b->reader, amount, iov));
+    if (res > 0) {
+        _reader_advance(b, res);
+    }
+    return res;
+}
+
+
+/** Search for the specified string within buffer
+
+
+  limit argument will be ignored if it's value is 0 or greater than data available
+  in the buffer.
+
+  if start is greater than data available in the buffer, then -1 is returned,
+  and errno set to indicate the error. <- TODO
+
+  Return: Index of the first occurance or -1 if not found.
+  */
+ssize_t
+mrb_search(struct mrb *b, const char *needle, size_t needlelen, size_t start,
+        ssize_t limit) {
+
+    size_t used;
+    unsigned char *s;
+    unsigned char *found;
+    ssize_t at;
+    if ((needle == NULL) || (needlelen == 0)) {
+        return -1;
+    }
+
+    used = mrb_used(b);
+    if ((start < 0) || (start >= used)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (limit <= 0) {
+        limit = used;
+    }
+    else {
+        limit = MIN(limit, used);
+    }
+
+    /* Without the mirror, search a copy of what wraps */
+    if (_span(b, b->reader + start, limit) < (size_t)limit) {
+        limit = MIN((size_t)limit, used - start);
+        s = malloc(limit);
+        if (s == NULL) {
+            return -1;
+        }
+        _copyout(b, s, b->reader + start, limit);
+        found = memmem(s, limit, needle, needlelen);
+        at = (found == NULL)? -1: (ssize_t)(start + (found - s));
+        free(s);
+        return at;
+    }
+
+    s = b->buff + b->reader;
+    s += start;
+
+    found = memmem(s, limit, needle, needlelen);
+    if (found == NULL) {
+        return -1;
+    }
+
+    return found - (b->buff + b->reader);
+}
+
+
+/** CRC32C of size bytes of the buffered data, starting offset bytes after
+  the reader, without copying it out of the buffer.
+
+  If the range exceeds the data available in the buffer, 0 is returned and
+  errno is set to EINVAL. 0 is a valid checksum as well, so a caller not
+  sure of the range has to clear errno before the call and check it after.
+  */
+uint32_t
+mrb_crc32c(struct mrb *b, size_t offset, size_t size) {
+    if ((offset + size) > mrb_used(b)) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    size_t first = _span(b, b->reader + offset, size);
+    uint32_t crc = mrb_crc32c_update(0, _at(b, b->reader + offset), first);
+    return mrb_crc32c_update(crc, b->buff, size - first);
+}
+
+
+/** xxHash64 of size bytes of the buffered data, starting offset bytes after
+  the reader.
+
+  If the range exceeds the data available in the buffer, or a copy is
+  needed (see MRB_NOMIRROR) and can not be allocated, 0 is returned and
+  errno is set to EINVAL or ENOMEM. 0 is a valid hash as well, so a caller
+  not sure of the range has to clear errno before the call and check it
+  after.
+  */
+uint64_t
+mrb_hash(struct mrb *b, size_t offset, size_t size, uint64_t seed) {
+    if ((offset + size) > mrb_used(b)) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    unsigned char *copy;
+    uint64_t hash;
+
+    if (_span(b, b->reader + offset, size) == size) {
+        return mrb_xxh64(_at(b, b->reader + offset), size, seed);
+    }
+
+    /* Wraps without the mirror, hash a copy */
+    copy = malloc(size);
+    if (copy == NULL) {
+        return 0;
+    }
+    _copyout(b, copy, b->reader + offset, size);
+    hash = mrb_xxh64(copy, size, seed);
+    free(copy);
+    return hash;
+}
+
+
+/** Start (or stop) checksumming everything put into the buffer. Tracking
+  restarts from zero on each call.
+  */
+void
+mrb_crc32c_track(struct mrb *b, bool enable) {
+    /* Build the tables now rather than in a signal handler putting data */
+    pthread_once(&_crc32conce, _crc32c_init);
+    b->crctrack = enable;
+    b->crc = 0;
+}
+
+
+/** CRC32C of the data put since the last mrb_crc32c_track() call.
+  */
+uint32_t
+mrb_crc32c_running(struct mrb *b) {
+    return b->crc;
+}
+
+
+/* Block compression, LZ4 block format (token, literals, 16 bit offset,
+   match length) framed by a small header in the destination ring:
+
+   uint32_t  compressed length | MRB_LZ_STORED
+   uint32_t  raw length
+   ...       compressed (or stored) block
+ */
+#define MRB_LZ_HDRSIZE 8
+#define MRB_LZ_STORED 0x80000000U
+#define MRB_LZ_HASHLOG 12
+#define MRB_LZ_MINMATCH 4
+#define MRB_LZ_LASTLITERALS 5
+#define MRB_LZ_MFLIMIT 12
+#define MRB_LZ_MAXOFFSET 65535
+#define MRB_LZ_BOUND(n) ((n) + ((n) / 255) + 16)
+
+
+static inline uint32_t
+_lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+
+static inline uint32_t
+_lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - MRB_LZ_HASHLOG);
+}
+
+
+static inline unsigned char *
+_lz_putlen(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+
+/* Returns the compressed length, or 0 if it would not fit in capacity. */
+static size_t
+_lz_compress(const unsigned char *src, size_t size, unsigned char *dst,
+        size_t capacity) {
+    uint32_t table[1 << MRB_LZ_HASHLOG] = {0};
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *iend = src + size;
+    const unsigned char *mflimit = iend - MRB_LZ_MFLIMIT;
+    const unsigned char *matchlimit = iend - MRB_LZ_LASTLITERALS;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + capacity;
+    unsigned int searches = 0;
+    size_t litlen;
+    size_t matchlen;
+
+    if (size < MRB_LZ_MFLIMIT + 1) {
+        goto lastliterals;
+    }
+
+    ip++;
+    while (ip < mflimit) {
+        uint32_t sequence = _lz_read32(ip);
+        uint32_t h = _lz_hash(sequence);
+        const unsigned char *ref = src + table[h];
+
+        table[h] = ip - src;
+        if ((ip - ref) > MRB_LZ_MAXOFFSET || _lz_read32(ref) != sequence) {
+            ip += 1 + (searches++ >> 6);
+            continue;
+        }
+        searches = 0;
+
+        /* Extend backwards over pending literals, then forward. */
+        while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+            ip--;
+            ref--;
+        }
+        matchlen = MRB_LZ_MINMATCH;
+        while (((ip + matchlen) < matchlimit) &&
+                (ip[matchlen] == ref[matchlen])) {
+            matchlen++;
+        }
+
+        litlen = ip - anchor;
+        if ((op + 1 + (litlen / 255) + 1 + litlen + 2 +
+                    ((matchlen - MRB_LZ_MINMATCH) / 255) + 1) > oend) {
+            return 0;
+        }
+
+        unsigned char *token = op++;
+        if (litlen >= 15) {
+            *token = 15 << 4;
+            op = _lz_putlen(op, litlen - 15);
+        }
+        else {
+            *token = litlen << 4;
+        }
+        memcpy(op, anchor, litlen);
+        op += litlen;
+
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+
+        if ((matchlen - MRB_LZ_MINMATCH) >= 15) {
+            *token |= 15;
+            op = _lz_putlen(op, matchlen - MRB_LZ_MINMATCH - 15);
+        }
+        else {
+            *token |= matchlen - MRB_LZ_MINMATCH;
+        }
+
+        ip += matchlen;
+        anchor = ip;
+    }
+
+lastliterals:
+    litlen = iend - anchor;
+    if ((op + 1 + (litlen / 255) + 1 + litlen) > oend) {
+        return 0;
+    }
+
+    if (litlen >= 15) {
+        *op++ = 15 << 4;
+        op = _lz_putlen(op, litlen - 15);
+    }
+    else {
+        *op++ = litlen << 4;
+    }
+    memcpy(op, anchor, litlen);
+    op += litlen;
+    return op - dst;
+}
+
+
+/* Returns the decompressed length, or -1 if the block is malformed or does
+   not fit in capacity. */
+static ssize_t
+_lz_decompress(const unsigned char *src, size_t size, unsigned char *dst,
+        size_t capacity) {
+    const unsigned char *ip = src;
+    const unsigned char *iend = src + size;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + capacity;
+    size_t len;
+    size_t offset;
+    unsigned char token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        len = token >> 4;
+        if (len == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                len += *ip;
+            } while (*ip++ == 255);
+        }
+        if ((len > (size_t)(iend - ip)) || (len > (size_t)(oend - op))) {
+            return -1;
+        }
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+
+        if (ip == iend) {
+            break;
+        }
+
+        if ((iend - ip) < 2) {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > (size_t)(op - dst))) {
+            return -1;
+        }
+
+        len = token & 15;
+        if (len == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                len += *ip;
+            } while (*ip++ == 255);
+        }
+        len += MRB_LZ_MINMATCH;
+        if (len > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        /* Overlapping copy is how LZ77 encodes runs, copy bytewise. */
+        const unsigned char *ref = op - offset;
+        if (offset >= len) {
+            memcpy(op, ref, len);
+            op += len;
+        }
+        else {
+            while (len--) {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    return op - dst;
+}
+
+
+/** Compress up to size bytes (at most MRB_COMPRESS_BLOCKMAX) from the
+  source buffer into a single block in the destination buffer.
+
+  Data is read straight from the source's readable region and compressed
+  straight into the destination's writable region, the mirror mapping
+  guarantees both are contiguous. If the destination has not enough room
+  the block is shrunk to fit. Incompressible data is stored as is.
+
+  Return: Number of bytes consumed from the source, 0 if the source is
+  empty, or -1 with errno set to ENOBUFS if the destination is full.
+  */
+ssize_t
+mrb_compress(struct mrb *dst, struct mrb *src, size_t size) {
+    size_t used = mrb_used(src);
+    size_t amount = MIN(MIN(size, used), MRB_COMPRESS_BLOCKMAX);
+    size_t avail = mrb_available(dst);
+    unsigned char *out = _wptr(dst);
+    unsigned char *in = src->buff + src->reader;
+    unsigned char *scratch = NULL;
+    uint32_t header[2];
+    size_t bound;
+    size_t clen;
+
+    if (amount == 0) {
+        return 0;
+    }
+
+    if ((MRB_LZ_HDRSIZE + MRB_LZ_BOUND(amount)) > avail) {
+        amount = avail > (MRB_LZ_HDRSIZE + 16)?
+            (avail - MRB_LZ_HDRSIZE - 16) * 255 / 256: 0;
+        if (amount == 0) {
+            errno = ENOBUFS;
+            return -1;
+        }
+    }
+
+    /* Without the mirror, work on a copy when either side wraps */
+    bound = MRB_LZ_HDRSIZE + MRB_LZ_BOUND(amount);
+    if ((_span(src, src->reader, amount) < amount) ||
+            (_span(dst, _woffset(dst), bound) < bound)) {
+        scratch = malloc(amount + bound);
+        if (scratch == NULL) {
+            return -1;
+        }
+        _copyout(src, scratch, src->reader, amount);
+        in = scratch;
+        out = scratch + amount;
+    }
+
+    clen = _lz_compress(in, amount, out + MRB_LZ_HDRSIZE, amount);
+    if (clen == 0) {
+        memcpy(out + MRB_LZ_HDRSIZE, in, amount);
+        header[0] = amount | MRB_LZ_STORED;
+        clen = amount;
+    }
+    else {
+        header[0] = clen;
+    }
+    header[1] = amount;
+    memcpy(out, header, MRB_LZ_HDRSIZE);
+
+    if (scratch) {
+        _copyin(dst, _woffset(dst), out, MRB_LZ_HDRSIZE + clen);
+        free(scratch);
+    }
+
+    _writer_advance(dst, MRB_LZ_HDRSIZE + clen);
+    _reader_advance(src, amount);
+    return amount;
+}
+
+
+/** Decompress the next block written by mrb_compress() from the source
+  buffer into the destination buffer.
+
+  Return: Number of bytes written to the destination, 0 if the source does
+  not hold a complete block yet, or -1 with errno set to ENOBUFS if the
+  destination can not hold the block, or EBADMSG if the block is corrupt.
+  */
+ssize_t
+mrb_decompress(struct mrb *dst, struct mrb *src) {
+    size_t used = mrb_used(src);
+    unsigned char *in = _at(src, src->reader + MRB_LZ_HDRSIZE);
+    unsigned char *out = _wptr(dst);
+    unsigned char *scratch = NULL;
+    uint32_t header[2];
+    size_t clen;
+    ssize_t rlen;
+
+    if (used < MRB_LZ_HDRSIZE) {
+        return 0;
+    }
+
+    _copyout(src, header, src->reader, MRB_LZ_HDRSIZE);
+    clen = header[0] & ~MRB_LZ_STORED;
+    if ((header[1] > MRB_COMPRESS_BLOCKMAX) || (clen > MRB_LZ_BOUND(header[1]))) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    if (used < (MRB_LZ_HDRSIZE + clen)) {
+        return 0;
+    }
+
+    if (header[1] > mrb_available(dst)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    /* Without the mirror, work on a copy when either side wraps */
+    if ((_span(src, src->reader + MRB_LZ_HDRSIZE, clen) < clen) ||
+            (_span(dst, _woffset(dst), header[1]) < header[1])) {
+        scratch = malloc(clen + header[1]);
+        if (scratch == NULL) {
+            return -1;
+        }
+        _copyout(src, scratch, src->reader + MRB_LZ_HDRSIZE, clen);
+        in = scratch;
+        out = scratch + clen;
+    }
+
+    if (header[0] & MRB_LZ_STORED) {
+        if (clen != header[1]) {
+            free(scratch);
+            errno = EBADMSG;
+            return -1;
+        }
+        memcpy(out, in, clen);
+        rlen = clen;
+    }
+    else {
+        rlen = _lz_decompress(in, clen, out, header[1]);
+        if (rlen != header[1]) {
+            free(scratch);
+            errno = EBADMSG;
+            return -1;
+        }
+    }
+
+    if (scratch) {
+        _copyin(dst, _woffset(dst), out, rlen);
+        free(scratch);
+    }
+
+    _writer_advance(dst, rlen);
+    _reader_advance(src, MRB_LZ_HDRSIZE + clen);
+    return rlen;
+}
+
+
+/** Cheap monotonic timestamp in nanoseconds, as used to stamp records.
+  Resolution is that of CLOCK_MONOTONIC_COARSE (a few milliseconds).
+  */
+uint64_t
+mrb_timestamp(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* Frame size bytes of payload already in place after the writer (leaving
+   room for the header) as the next record. */
+static void
+_record_append(struct mrb *b, size_t size, uint64_t timestamp,
+        uint32_t flags) {
+    struct mrb_record record = {
+        .size = size,
+        .flags = flags,
+        .timestamp = timestamp,
+    };
+    uint64_t seq = b->msgwrite + b->msgpending;
+
+    _copyin(b, _woffset(b), &record, MRB_RECORD_HDRSIZE);
+    if (b->index) {
+        b->index[seq % b->indexsize] = b->wseq + b->pending;
+        if ((seq - b->indexhead) == b->indexsize) {
+            b->indexhead++;
+        }
+    }
+    b->msgpending++;
+    _writer_advance(b, MRB_RECORD_HDRSIZE + size);
+}
+
+
+/** Put a record stamped with the given timestamp, only if all of it will
+  fit.
+  */
+int
+mrb_recputts(struct mrb *b, const char *restrict source, size_t size,
+        uint64_t timestamp) {
+    if ((size > UINT32_MAX) ||
+            ((MRB_RECORD_HDRSIZE + size) > mrb_available(b))) {
+        return -1;
+    }
+
+    _copyin(b, _woffset(b) + MRB_RECORD_HDRSIZE, source, size);
+    _record_append(b, size, timestamp, 0);
+    return 0;
+}
+
+
+/** Put a record stamped with mrb_timestamp(), only if all of it will fit.
+  */
+int
+mrb_recput(struct mrb *b, const char *restrict source, size_t size) {
+    return mrb_recputts(b, source, size, mrb_timestamp());
+}
+
+
+/** Read the header of the next record without consuming it.
+
+  Return: 0 on success, -1 if there is no complete record in the buffer.
+  */
+int
+mrb_recpeek(struct mrb *b, struct mrb_record *record) {
+    size_t used = mrb_used(b);
+
+    if (used < MRB_RECORD_HDRSIZE) {
+        return -1;
+    }
+
+    _copyout(b, record, b->reader, MRB_RECORD_HDRSIZE);
+    if ((MRB_RECORD_HDRSIZE + record->size) > used) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static inline void
+_record_consume(struct mrb *b, struct mrb_record *record) {
+    _reader_advance(b, MRB_RECORD_HDRSIZE + record->size);
+    b->msgread++;
+}
+
+
+/** Copy the payload of the next record to a caller location and consume
+  it. The record's timestamp is stored in timestamp when it is not NULL.
+
+  Return: Payload size, or -1 with errno set to EAGAIN if there is no
+  complete record, or EMSGSIZE if the record does not fit in dest.
+  */
+ssize_t
+mrb_recget(struct mrb *b, char *dest, size_t size, uint64_t *timestamp) {
+    struct mrb_record record;
+
+    if (mrb_recpeek(b, &record)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (record.size > size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    _copyout(b, dest, b->reader + MRB_RECORD_HDRSIZE, record.size);
+    if (timestamp) {
+        *timestamp = record.timestamp;
+    }
+    _record_consume(b, &record);
+    return record.size;
+}
+
+
+/** Drop records stamped before timestamp, only their headers are read.
+
+  Return: Number of records evicted.
+  */
+size_t
+mrb_evict_older_than(struct mrb *b, uint64_t timestamp) {
+    struct mrb_record record;
+    size_t count = 0;
+
+    while ((mrb_recpeek(b, &record) == 0) && (record.timestamp < timestamp)) {
+        _record_consume(b, &record);
+        count++;
+    }
+
+    return count;
+}
+
+
+/** Keep the offsets of the last capacity records in a side index, so
+  buffered records can be reached in O(1) without walking their headers.
+  Records have to be consumed with mrb_recget() or mrb_evict_older_than()
+  for the index to stay in sync.
+  */
+int
+mrb_index_enable(struct mrb *b, size_t capacity) {
+    uint64_t *index;
+
+    /* The index lives in private memory */
+    if ((capacity == 0) || (b->flags & MRB_SHARED)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    index = malloc(capacity * sizeof(uint64_t));
+    if (index == NULL) {
+        return -1;
+    }
+
+    free(b->index);
+    b->index = index;
+    b->indexsize = capacity;
+    b->indexhead = b->msgwrite + b->msgpending;
+    return 0;
+}
+
+
+/** Number of complete records in the buffer.
+  */
+size_t
+mrb_msg_count(struct mrb *b) {
+    return b->msgwrite - b->msgread;
+}
+
+
+/** Sequence number of the next record to be read, records are numbered
+  from zero in the order they are put.
+  */
+uint64_t
+mrb_msg_seq(struct mrb *b) {
+    return b->msgread;
+}
+
+
+/** Find a buffered (or retained) record by its sequence number using the
+  index.
+
+  Return: Pointer to the payload of the record within the buffer, size is
+  set to its length. NULL with errno set to ENOENT if the record is not
+  buffered or has fallen out of the index, or ERANGE if the payload wraps
+  in a buffer without the mirror (see MRB_NOMIRROR), use mrb_read_at() then.
+  */
+const char *
+mrb_msg_find(struct mrb *b, uint64_t seq, size_t *size) {
+    struct mrb_record record;
+    uint64_t position;
+
+    if ((b->index == NULL) || (seq < b->indexhead) || (seq >= b->msgwrite)) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    position = b->index[seq % b->indexsize];
+    if (position < b->tseq) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    position = (position % b->size) + MRB_RECORD_HDRSIZE;
+    _copyout(b, &record, position - MRB_RECORD_HDRSIZE, MRB_RECORD_HDRSIZE);
+    if (_span(b, position, record.size) < record.size) {
+        errno = ERANGE;
+        return NULL;
+    }
+
+    if (size) {
+        *size = record.size;
+    }
+    return (const char *)_at(b, position);
+}
+
+
+/** Find the nth buffered record, 0 is the next one to be read.
+  */
+const char *
+mrb_msg_at(struct mrb *b, size_t n, size_t *size) {
+    return mrb_msg_find(b, b->msgread + n, size);
+}
+
+
+/** Binary search the indexed records for the first one stamped at or after
+  timestamp.
+
+  Return: Its sequence number, or -1 with errno set to ENOENT if there is no
+  such record in the index.
+  */
+int64_t
+mrb_msg_search(struct mrb *b, uint64_t timestamp) {
+    struct mrb_record record;
+    uint64_t lo = MAX(b->msgread, b->indexhead);
+    uint64_t hi = b->msgwrite;
+    uint64_t mid;
+
+    if (b->index == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        _copyout(b, &record, b->index[mid % b->indexsize] % b->size,
+                MRB_RECORD_HDRSIZE);
+        if (record.timestamp < timestamp) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if (lo == b->msgwrite) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return lo;
+}
+
+
+/** Absolute position of the writer, the total number of bytes ever put.
+  */
+uint64_t
+mrb_seq_writer(struct mrb *b) {
+    return b->wseq;
+}
+
+
+/** Absolute position of the reader, the total number of bytes ever
+  consumed.
+  */
+uint64_t
+mrb_seq_reader(struct mrb *b) {
+    return b->rseq;
+}
+
+
+/** Absolute position of the oldest byte still readable by mrb_read_at().
+  */
+uint64_t
+mrb_seq_tail(struct mrb *b) {
+    return b->tseq;
+}
+
+
+/** Keep consumed data in the buffer until it is explicitly released with
+  mrb_release(). Disabling retention releases everything consumed so far.
+  */
+void
+mrb_retain(struct mrb *b, bool enable) {
+    b->retain = enable;
+    if (!enable) {
+        _tail_set(b, b->reader, b->rseq);
+    }
+}
+
+
+/** Release retained data before the absolute position seq, allowing the
+  writer to reuse its space.
+  */
+int
+mrb_release(struct mrb *b, uint64_t seq) {
+    if ((seq < b->tseq) || (seq > b->rseq)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _tail_set(b, (b->tail + (seq - b->tseq)) % b->size, seq);
+    return 0;
+}
+
+
+/** Copy data from an absolute position to a caller location, whether it is
+  consumed or not, as long as it is still retained. Buffer state is not
+  modified.
+
+  Return: Number of bytes copied, or -1 with errno set to ERANGE if the
+  position is not retained (any more) or not written yet.
+  */
+ssize_t
+mrb_read_at(struct mrb *b, uint64_t seq, char *dest, size_t size) {
+    size_t amount;
+
+    if ((seq < b->tseq) || (seq > b->wseq)) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    amount = MIN(size, b->wseq - seq);
+    _copyout(b, dest, seq % b->size, amount);
+    return amount;
+}
+
+
+/** Obtain a pointer to size bytes of contiguous writable space, to be
+  filled in place and made part of the buffer with mrb_commit().
+  Without the mirror (see MRB_NOMIRROR) the space has to fit before the
+  end of the buffer. Async-signal-safe.
+
+  Return: NULL with errno set to ENOBUFS if there is not enough room.
+  */
+char *
+mrb_reserve(struct mrb *b, size_t size) {
+    size_t avail = mrb_available(b);
+
+    if (size > _span(b, _woffset(b), avail)) {
+        errno = ENOBUFS;
+        return NULL;
+    }
+
+    return (char *)_wptr(b);
+}
+
+
+/** Append size bytes written in place after mrb_reserve() to the buffer.
+  Async-signal-safe.
+  */
+int
+mrb_commit(struct mrb *b, size_t size) {
+    if (size > mrb_available(b)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _writer_advance(b, size);
+    return 0;
+}
+
+
+/** Begin a writer transaction, nothing put until mrb_txcommit() is visible
+  to the reader and all of it can be dropped with mrb_txabort().
+  */
+int
+mrb_txbegin(struct mrb *b) {
+    if (b->tx) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    b->tx = true;
+    return 0;
+}
+
+
+/** Make everything put since mrb_txbegin() visible at once.
+  */
+int
+mrb_txcommit(struct mrb *b) {
+    if (!b->tx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    b->tx = false;
+    _publish(b);
+    return 0;
+}
+
+
+/** Drop everything put since mrb_txbegin().
+  */
+int
+mrb_txabort(struct mrb *b) {
+    if (!b->tx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    b->tx = false;
+    b->pending = 0;
+    b->msgpending = 0;
+    if (b->indexhead > b->msgwrite) {
+        b->indexhead = b->msgwrite;
+    }
+    return 0;
+}
+
+
+/** Put the textual representation of an unsigned integer in the given base
+  (2 to 16), only if all of it will fit. Unlike mrb_print() this is
+  async-signal-safe.
+  */
+int
+mrb_putuint(struct mrb *b, uint64_t value, int base) {
+    char digits[64];
+    char *p = digits + sizeof(digits);
+
+    if ((base < 2) || (base > 16)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    do {
+        *--p = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value);
+
+    return mrb_putall(b, p, digits + sizeof(digits) - p);
+}
+
+
+/** Put the decimal representation of a signed integer, only if all of it
+  will fit. Async-signal-safe.
+  */
+int
+mrb_putint(struct mrb *b, int64_t value) {
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    uint64_t magnitude = value < 0? -(uint64_t)value: (uint64_t)value;
+
+    do {
+        *--p = '0' + (magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+
+    if (value < 0) {
+        *--p = '-';
+    }
+
+    return mrb_putall(b, p, digits + sizeof(digits) - p);
+}
+
+
+/** write(2) everything still in the buffer, retained history included, to
+  fd without consuming it. Meant for dumping an in-memory trace from a
+  crash handler, so it only uses write(2) and is async-signal-safe.
+
+  Return: Number of bytes written, or -1 if write(2) fails.
+  */
+ssize_t
+mrb_dump(struct mrb *b, int fd) {
+    size_t offset = b->tail;
+    size_t remaining = b->wseq - b->tseq;
+    size_t total = 0;
+    ssize_t res;
+
+    while (remaining) {
+        res = write(fd, _at(b, offset), _span(b, offset, remaining));
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        offset += res;
+        remaining -= res;
+        total += res;
+    }
+
+    return total;
+}
+
+
+/** write(2) whole pages from the buffer, for file descriptors opened with
+  O_DIRECT. The buffer is page aligned, so as long as the reader only moves
+  in whole pages every write is aligned in memory, offset and length. Data
+  short of a page is held back until more arrives or mrb_flush_direct().
+
+  Return: Number of bytes written, 0 if less than a page is buffered, or -1
+  with errno set to EINVAL if the reader is not page aligned.
+  */
+ssize_t
+mrb_writeout_direct(struct mrb *b, int fd, size_t size) {
+    size_t pagesize = getpagesize();
+    size_t used = mrb_used(b);
+    size_t amount = MIN(size, used);
+    ssize_t res;
+
+    if ((b->reader % pagesize) || (b->flags & MRB_SMALL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    amount -= amount % pagesize;
+    if (amount == 0) {
+        return 0;
+    }
+
+    res = write(fd, b->buff + b->reader, _span(b, b->reader, amount));
+    if (res > 0) {
+        _reader_advance(b, res);
+    }
+    return res;
+}
+
+
+/** Write everything left in the buffer to an O_DIRECT file descriptor. The
+  unaligned tail is written padded to a whole page, then the file is
+  truncated back to its real length and the file offset placed right after
+  the data. Meant as the last write to the file.
+
+  Return: Number of bytes written (excluding padding), or -1 on error.
+  */
+ssize_t
+mrb_flush_direct(struct mrb *b, int fd) {
+    size_t pagesize = getpagesize();
+    size_t total = 0;
+    size_t tail;
+    off_t offset;
+    ssize_t res;
+
+    while ((res = mrb_writeout_direct(b, fd, SIZE_MAX)) > 0) {
+        total += res;
+    }
+    if (res < 0) {
+        return -1;
+    }
+
+    tail = mrb_used(b);
+    if (tail == 0) {
+        return total;
+    }
+
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0) {
+        return -1;
+    }
+
+    /* The padding is whatever follows the data in the mapping */
+    res = write(fd, b->buff + b->reader, pagesize);
+    if (res < (ssize_t)tail) {
+        return -1;
+    }
+
+    if (ftruncate(fd, offset + tail) ||
+            (lseek(fd, offset + tail, SEEK_SET) < 0)) {
+        return -1;
+    }
+
+    _reader_advance(b, tail);
+    return total + tail;
+}
+
+
+/** Send data from the buffer to a socket with sendfile(2), straight from
+  the page cache of the backing file (see MRB_FILE), in two calls when the
+  data wraps. Falls back to mrb_writeout() for buffers without a backing
+  file or when sendfile(2) is not supported for fd.
+  */
+ssize_t
+mrb_sendout(struct mrb *b, int fd, size_t size) {
+    size_t used = mrb_used(b);
+    size_t amount = MIN(size, used);
+    size_t first = MIN(amount, b->size - b->reader);
+    off_t offset = b->reader;
+    ssize_t res;
+    ssize_t total;
+
+    if (b->fd < 0) {
+        return mrb_writeout(b, fd, size);
+    }
+
+    res = sendfile(fd, b->fd, &offset, first);
+    if (res < 0) {
+        if ((errno == EINVAL) || (errno == ENOSYS)) {
+            return mrb_writeout(b, fd, size);
+        }
+        return -1;
+    }
+    total = res;
+
+    if (((size_t)res == first) && (amount > first)) {
+        offset = 0;
+        res = sendfile(fd, b->fd, &offset, amount - first);
+        if (res > 0) {
+            total += res;
+        }
+    }
+
+    if (total > 0) {
+        _reader_advance(b, total);
+    }
+    return total;
+}
+
+
+/** Prepare to send data from the buffer to the socket fd with
+  MSG_ZEROCOPY. The buffer switches to retention (see mrb_retain()): data
+  handed to the kernel stays put until mrb_zcreap() sees the kernel is done
+  with it, only then its space is reclaimed.
+
+  Return: 0 on success, -1 with errno set, to EINVAL for a buffer shared
+  with other processes (see MRB_SHARED) as the bookkeeping is private.
+  */
+int
+mrb_zerocopy_enable(struct mrb *b, int fd) {
+    int one = 1;
+
+    if (b->flags & MRB_SHARED) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))) {
+        return -1;
+    }
+
+    if (b->zc == NULL) {
+        b->zc = calloc(1, sizeof(struct mrb_zerocopy));
+        if (b->zc == NULL) {
+            return -1;
+        }
+    }
+
+    mrb_retain(b, true);
+    return 0;
+}
+
+
+/** send(2) data from the buffer with MSG_ZEROCOPY. The reader advances, but
+  the space is reclaimed by mrb_zcreap() once the kernel completes the send.
+
+  Return: Number of bytes sent, or -1 with errno set to ENOBUFS if too many
+  sends are in flight, call mrb_zcreap() first.
+  */
+ssize_t
+mrb_sendzc(struct mrb *b, int fd, size_t size) {
+    struct mrb_zerocopy *zc = b->zc;
+    size_t used = mrb_used(b);
+    size_t amount = MIN(size, used);
+    ssize_t res;
+
+    if (zc == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((zc->next - zc->head) == MRB_ZC_INFLIGHT) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (amount == 0) {
+        return 0;
+    }
+
+    res = send(fd, b->buff + b->reader, _span(b, b->reader, amount),
+            MSG_ZEROCOPY);
+    if (res > 0) {
+        _reader_advance(b, res);
+        zc->end[zc->next % MRB_ZC_INFLIGHT] = b->rseq;
+        zc->done[zc->next % MRB_ZC_INFLIGHT] = false;
+        zc->next++;
+    }
+    return res;
+}
+
+
+/** Read MSG_ZEROCOPY completions from the error queue of fd, without
+  blocking, and release the space of every completed send.
+
+  Return: Number of sends still in flight, or -1 on error.
+  */
+ssize_t
+mrb_zcreap(struct mrb *b, int fd) {
+    struct mrb_zerocopy *zc = b->zc;
+    struct sock_extended_err *serr;
+    struct cmsghdr *cmsg;
+    union {
+        char buff[128];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    uint32_t id;
+    bool released = false;
+
+    if (zc == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control.buff;
+        msg.msg_controllen = sizeof(control.buff);
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
+            return -1;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+                cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            /* Completed range of send ids, inclusive */
+            for (id = serr->ee_info; (id - serr->ee_info) <=
+                    (serr->ee_data - serr->ee_info); id++) {
+                if ((id - zc->head) < (zc->next - zc->head)) {
+                    zc->done[id % MRB_ZC_INFLIGHT] = true;
+                }
+            }
+        }
+    }
+
+    /* Release in order, up to the first send still in flight */
+    while ((zc->head != zc->next) && zc->done[zc->head % MRB_ZC_INFLIGHT]) {
+        zc->head++;
+        released = true;
+    }
+
+    if (released) {
+        mrb_release(b, zc->end[(zc->head - 1) % MRB_ZC_INFLIGHT]);
+    }
+
+    return zc->next - zc->head;
+}
+
+
+/** Receive up to max_msgs datagrams (at most MRB_MMSG_MAX) with a single
+  recvmmsg(2) call, straight into the buffer as records (see mrb_recput()).
+  Same as mrb_recvmmsgex() with room for datagrams of any size.
+  */
+ssize_t
+mrb_recvmmsg(struct mrb *b, int fd, size_t max_msgs) {
+    return mrb_recvmmsgex(b, fd, max_msgs, MRB_MMSG_DGRAMMAX);
+}
+
+
+/** Receive up to max_msgs datagrams (at most MRB_MMSG_MAX) of up to
+  max_size bytes each with a single recvmmsg(2) call, straight into the
+  buffer as records (see mrb_recput()). Only as many datagrams as the
+  writable space has room for at max_size each are asked for, and the
+  records are packed after the call. Larger datagrams are truncated and
+  flagged MRB_RECORD_TRUNC, as is a datagram larger than all of the
+  writable space when there is not even room for max_size bytes. The
+  source address is not kept.
+
+  Return: Number of records received, or -1 with errno set by recvmmsg(2),
+  or ENOBUFS if there is no room for a single record.
+  */
+ssize_t
+mrb_recvmmsgex(struct mrb *b, int fd, size_t max_msgs, size_t max_size) {
+    struct mmsghdr msgs[MRB_MMSG_MAX];
+    struct iovec iovs[MRB_MMSG_MAX * 2];
+    size_t avail = mrb_available(b);
+    size_t base = _woffset(b);
+    size_t payload;
+    uint64_t timestamp;
+    size_t slot;
+    size_t n;
+    int res;
+    int i;
+
+    slot = MIN(max_size, MRB_MMSG_DGRAMMAX);
+    slot += MRB_RECORD_HDRSIZE;
+    n = MIN(max_msgs, MRB_MMSG_MAX);
+    n = MIN(n, avail / slot);
+    if ((n == 0) && (max_msgs > 0) && (avail > MRB_RECORD_HDRSIZE)) {
+        /* Not even room for one full slot, offer what there is */
+        n = 1;
+        slot = avail;
+    }
+
+    if (n == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+    for (i = 0; i < (int)n; i++) {
+        msgs[i].msg_hdr.msg_iov = &iovs[i * 2];
+        msgs[i].msg_hdr.msg_iovlen = _iov(b, base + i * slot +
+                MRB_RECORD_HDRSIZE, slot - MRB_RECORD_HDRSIZE, &iovs[i * 2]);
+    }
+
+    res = recvmmsg(fd, msgs, n, MSG_WAITFORONE, NULL);
+    if (res <= 0) {
+        return res;
+    }
+
+    /* Pack the records, each one moves left of its slot */
+    timestamp = mrb_timestamp();
+    for (i = 0; i < res; i++) {
+        payload = _woffset(b) + MRB_RECORD_HDRSIZE;
+        if (payload != (base + i * slot + MRB_RECORD_HDRSIZE)) {
+            _move(b, payload, base + i * slot + MRB_RECORD_HDRSIZE,
+                    msgs[i].msg_len);
+        }
+        _record_append(b, msgs[i].msg_len, timestamp,
+                (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)? MRB_RECORD_TRUNC: 0);
+    }
+
+    return res;
+}
+
+
+/** Send up to max_msgs records (at most MRB_MMSG_MAX) as one datagram each
+  with a single sendmmsg(2) call, straight from the buffer. Sent records
+  are consumed.
+
+  Return: Number of records sent, or -1 with errno set by sendmmsg(2).
+  */
+ssize_t
+mrb_sendmmsg(struct mrb *b, int fd, size_t max_msgs) {
+    struct mmsghdr msgs[MRB_MMSG_MAX];
+    struct iovec iovs[MRB_MMSG_MAX * 2];
+    size_t sizes[MRB_MMSG_MAX];
+    struct mrb_record record;
+    size_t used = mrb_used(b);
+    size_t offset = 0;
+    size_t n;
+    int res;
+    int i;
+
+    n = MIN(max_msgs, MRB_MMSG_MAX);
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+    for (i = 0; i < (int)n; i++) {
+        if ((used - offset) < MRB_RECORD_HDRSIZE) {
+            break;
+        }
+        _copyout(b, &record, b->reader + offset, MRB_RECORD_HDRSIZE);
+        if ((used - offset - MRB_RECORD_HDRSIZE) < record.size) {
+            break;
+        }
+
+        sizes[i] = record.size;
+        msgs[i].msg_hdr.msg_iov = &iovs[i * 2];
+        msgs[i].msg_hdr.msg_iovlen = _iov(b, b->reader + offset +
+                MRB_RECORD_HDRSIZE, record.size, &iovs[i * 2]);
+        offset += MRB_RECORD_HDRSIZE + record.size;
+    }
+
+    if (i == 0) {
+        return 0;
+    }
+
+    res = sendmmsg(fd, msgs, i, 0);
+    for (i = 0; i < res; i++) {
+        record.size = sizes[i];
+        _record_consume(b, &record);
+    }
+
+    return res;
+}
+
+
+/** recvmsg(2) from a socket with SO_TIMESTAMPING (or SO_TIMESTAMPNS)
+  enabled into the buffer as a single record, stamped with the kernel's
+  receive timestamp: the hardware one if present (MRB_RECORD_TSHARD),
+  otherwise the software one (MRB_RECORD_TSSOFT). Both are in the clock of
+  the kernel timestamp (CLOCK_REALTIME for software), not mrb_timestamp().
+  Without a kernel timestamp the record is stamped with CLOCK_REALTIME too
+  and no flag, so software stamped and unstamped records still sort in
+  one clock. Nothing is put when recvmsg(2) returns 0.
+
+  Return: Payload size, or -1 with errno set by recvmsg(2), or ENOBUFS if
+  there is no room for a record.
+  */
+ssize_t
+mrb_recvts(struct mrb *b, int fd, size_t size) {
+    union {
+        char buff[CMSG_SPACE(sizeof(struct scm_timestamping))];
+        struct cmsghdr align;
+    } control;
+    struct scm_timestamping *tss;
+    struct timespec *ts;
+    struct timespec now;
+    struct cmsghdr *cmsg;
+    size_t avail = mrb_available(b);
+    struct iovec iov[2];
+    struct msghdr msg;
+    uint64_t timestamp = 0;
+    uint32_t flags = 0;
+    ssize_t res;
+
+    if (avail <= MRB_RECORD_HDRSIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    size = MIN(MIN(size, avail - MRB_RECORD_HDRSIZE), UINT32_MAX);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = _iov(b, _woffset(b) + MRB_RECORD_HDRSIZE, size, iov);
+    msg.msg_control = control.buff;
+    msg.msg_controllen = sizeof(control.buff);
+
+    res = recvmsg(fd, &msg, 0);
+    if (res <= 0) {
+        return res;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+
+        if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+            if (tss->ts[2].tv_sec || tss->ts[2].tv_nsec) {
+                ts = &tss->ts[2];
+                flags = MRB_RECORD_TSHARD;
+            }
+            else {
+                ts = &tss->ts[0];
+                flags = MRB_RECORD_TSSOFT;
+            }
+        }
+        else if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            ts = (struct timespec *)CMSG_DATA(cmsg);
+            flags = MRB_RECORD_TSSOFT;
+        }
+        else {
+            continue;
+        }
+
+        timestamp = ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+    }
+
+    if (flags == 0) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
+
+    if (msg.msg_flags & MSG_TRUNC) {
+        flags |= MRB_RECORD_TRUNC;
+    }
+
+    _record_append(b, res, timestamp, flags);
+    return res;
+}
+
+
+/* Validate and allocate (or reuse) the watermarks of b. */
+static struct mrb_watermark *
+_watermark_alloc(struct mrb *b, size_t high, size_t low) {
+    struct mrb_watermark *wm = b->wm;
+
+    if ((low >= high) || (high >= b->size) || (b->flags & MRB_SHARED)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (wm == NULL) {
+        wm = calloc(1, sizeof(struct mrb_watermark));
+        if (wm == NULL) {
+            return NULL;
+        }
+    }
+
+    wm->high = high;
+    wm->low = low;
+    wm->above = false;
+    wm->busy = 0;
+    return wm;
+}
+
+
+/** Call callback when the fill level, retained and uncommitted data
+  included, reaches high (with above set) and again when it drops back to
+  low (with above cleared), once per crossing, from whichever side of the
+  buffer crosses. The callback may run in a signal handler if the buffer
+  is written from one, but never twice at once: when both sides cross
+  together one of them runs the calls in order, the last one matching the
+  buffer. Crossing is evaluated right away too. A zero high removes the
+  watermarks.
+
+  Return: 0 on success, or -1 with errno set to EINVAL if low is not below
+  high, or high is beyond the capacity, or the buffer is MRB_SHARED.
+  */
+int
+mrb_watermark(struct mrb *b, size_t high, size_t low,
+        mrb_watermark_cb callback, void *arg) {
+    struct mrb_watermark *wm;
+
+    if (high == 0) {
+        free(b->wm);
+        b->wm = NULL;
+        return 0;
+    }
+
+    if (callback == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    wm = _watermark_alloc(b, high, low);
+    if (wm == NULL) {
+        return -1;
+    }
+
+    wm->callback = callback;
+    wm->arg = arg;
+    wm->epfd = -1;
+    b->wm = wm;
+    _watermark_check(b);
+    return 0;
+}
+
+
+/** Backpressure for a buffer filled from fd, which is registered with
+  epfd as event: EPOLLIN interest is dropped when the fill level reaches
+  high, and restored when the consumer brings it back to low.
+  */
+int
+mrb_watermark_epoll(struct mrb *b, size_t high, size_t low, int epfd,
+        int fd, const struct epoll_event *event) {
+    struct mrb_watermark *wm;
+
+    if (high == 0) {
+        return mrb_watermark(b, 0, 0, NULL, NULL);
+    }
+
+    wm = _watermark_alloc(b, high, low);
+    if (wm == NULL) {
+        return -1;
+    }
+
+    wm->callback = NULL;
+    wm->arg = NULL;
+    wm->epfd = epfd;
+    wm->fd = fd;
+    wm->event = *event;
+    b->wm = wm;
+    _watermark_check(b);
+    return 0;
+}
+
+
+/* Size of a logged argument in the record, strings are kept with their
+   terminating NUL so the consumer formats them in place. */
+static size_t
+_log_argsize(char type, va_list *args) {
+    const char *string;
+
+    switch (type) {
+        case 'i': va_arg(*args, int); break;
+        case 'I': va_arg(*args, unsigned int); break;
+        case 'l': va_arg(*args, long); break;
+        case 'L': va_arg(*args, unsigned long); break;
+        case 'q': va_arg(*args, long long); break;
+        case 'Q': va_arg(*args, unsigned long long); break;
+        case 'd': va_arg(*args, double); break;
+        case 's':
+            string = va_arg(*args, const char *);
+            return sizeof(uint32_t) + strlen(string? string: "(null)") + 1;
+        default: va_arg(*args, void *); break;
+    }
+
+    return sizeof(uint64_t);
+}
+
+
+/** Put a log record (see MRB_LOG()) holding the descriptor and the raw
+  argument values, strings copied, only if all of it will fit. Formatting
+  is left to the consumer, see mrb_log_decode(). The descriptor is stored
+  by address, so it must outlive the record and the consumer has to be the
+  same running process (addresses differ between runs of a PIE binary),
+  MRB_LOG() makes it static.
+
+  Return: 0 on success, -1 with errno set to ENOBUFS if it does not fit.
+  */
+int
+mrb_log(struct mrb *b, const struct mrb_logfmt *fmt, ...) {
+    size_t offset = _woffset(b) + MRB_RECORD_HDRSIZE;
+    size_t size = sizeof(fmt);
+    const char *type;
+    const char *string;
+    uint64_t value;
+    uint32_t len;
+    va_list args;
+    double real;
+
+    va_start(args, fmt);
+    for (type = fmt->types; *type; type++) {
+        size += _log_argsize(*type, &args);
+    }
+    va_end(args);
+
+    if ((size > UINT32_MAX) ||
+            ((MRB_RECORD_HDRSIZE + size) > mrb_available(b))) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    _copyin(b, offset, &fmt, sizeof(fmt));
+    offset += sizeof(fmt);
+    va_start(args, fmt);
+    for (type = fmt->types; *type; type++) {
+        switch (*type) {
+            case 'i': value = (int64_t)va_arg(args, int); break;
+            case 'I': value = va_arg(args, unsigned int); break;
+            case 'l': value = (int64_t)va_arg(args, long); break;
+            case 'L': value = va_arg(args, unsigned long); break;
+            case 'q': value = (int64_t)va_arg(args, long long); break;
+            case 'Q': value = va_arg(args, unsigned long long); break;
+            case 'd':
+                real = va_arg(args, double);
+                memcpy(&value, &real, sizeof(value));
+                break;
+            case 's':
+                string = va_arg(args, const char *);
+                string = string? string: "(null)";
+                len = strlen(string) + 1;
+                _copyin(b, offset, &len, sizeof(len));
+                _copyin(b, offset + sizeof(len), string, len);
+                offset += sizeof(len) + len;
+                continue;
+            default: value = (uintptr_t)va_arg(args, void *); break;
+        }
+        _copyin(b, offset, &value, sizeof(value));
+        offset += sizeof(value);
+    }
+    va_end(args);
+
+    _record_append(b, size, mrb_timestamp(), MRB_RECORD_LOG);
+    return 0;
+}
+
+
+/* Step over the next logged argument. */
+static void
+_log_skip(char type, const unsigned char **arg) {
+    uint32_t len;
+
+    if (type == 's') {
+        memcpy(&len, *arg, sizeof(len));
+        *arg += sizeof(len) + len;
+        return;
+    }
+    *arg += sizeof(uint64_t);
+}
+
+
+/* Length modifier of the conversion ending spec (n bytes): '\0' for none,
+   'H' for hh, 'q' for ll or q, the modifier itself for the others, '?' if
+   it is not valid. */
+static char
+_log_length(const char *spec, size_t n) {
+    size_t i = n - 1;
+
+    while ((i > 1) && strchr("hlLqjzt", spec[i - 1])) {
+        i--;
+    }
+
+    switch (n - 1 - i) {
+        case 0:
+            return '\0';
+        case 1:
+            return spec[i];
+        case 2:
+            if (spec[i] == spec[i + 1]) {
+                if (spec[i] == 'h') {
+                    return 'H';
+                }
+                if (spec[i] == 'l') {
+                    return 'q';
+                }
+            }
+            return '?';
+        default:
+            return '?';
+    }
+}
+
+
+/* Whether the conversion, with its length modifier, can print the logged
+   type, anything else is copied as is instead of handing snprintf(3) a
+   wrong argument. */
+static bool
+_log_compatible(char conversion, char length, char type) {
+    if (conversion == 's') {
+        return (type == 's') && (length == '\0');
+    }
+    if (strchr("fFeEgGaA", conversion)) {
+        return (type == 'd') &&
+            ((length == '\0') || (length == 'l') || (length == 'L'));
+    }
+    if ((type == 's') || (type == 'd')) {
+        return false;
+    }
+    if (strchr("diouxX", conversion)) {
+        return (length == '\0') || (strchr("Hhlqjzt", length) != NULL);
+    }
+    if ((conversion == 'c') || (conversion == 'p')) {
+        return length == '\0';
+    }
+    return false;
+}
+
+
+/* Format one conversion with the next logged argument, converted to the
+   type the conversion and its length modifier expect. */
+static int
+_log_format(char *dest, size_t size, const char *spec, char conversion,
+        char length, char type, const unsigned char **arg) {
+    uint64_t value;
+    uint32_t len;
+    double real;
+
+    if (type == 's') {
+        memcpy(&len, *arg, sizeof(len));
+        *arg += sizeof(len) + len;
+        return snprintf(dest, size, spec, (const char *)*arg - len);
+    }
+
+    memcpy(&value, *arg, sizeof(value));
+    *arg += sizeof(value);
+    if (type == 'd') {
+        memcpy(&real, &value, sizeof(real));
+        if (length == 'L') {
+            return snprintf(dest, size, spec, (long double)real);
+        }
+        return snprintf(dest, size, spec, real);
+    }
+
+    /* Signed values are kept sign extended, unsigned ones zero extended */
+    if (conversion == 'p') {
+        return snprintf(dest, size, spec, (void *)(uintptr_t)value);
+    }
+
+    if (strchr("dic", conversion)) {
+        switch (length) {
+            case 'l': return snprintf(dest, size, spec, (long)value);
+            case 'q': return snprintf(dest, size, spec, (long long)value);
+            case 'j': return snprintf(dest, size, spec, (intmax_t)value);
+            case 'z': return snprintf(dest, size, spec, (ssize_t)value);
+            case 't': return snprintf(dest, size, spec, (ptrdiff_t)value);
+            default: return snprintf(dest, size, spec, (int)value);
+        }
+    }
+
+    switch (length) {
+        case 'l': return snprintf(dest, size, spec, (unsigned long)value);
+        case 'q': return snprintf(dest, size, spec, (unsigned long long)value);
+        case 'j': return snprintf(dest, size, spec, (uintmax_t)value);
+        case 'z': return snprintf(dest, size, spec, (size_t)value);
+        case 't': return snprintf(dest, size, spec, (ptrdiff_t)value);
+        default: return snprintf(dest, size, spec, (unsigned int)value);
+    }
+}
+
+
+/** Format the next log record (see mrb_log()) into dest as snprintf(3)
+  would, and consume it. The record's timestamp is stored in timestamp
+  when it is not NULL. Each argument is converted to the type its
+  conversion and length modifier expect, so "%ld" prints a logged int
+  right. Conversions beyond the logged arguments, with a '*' width or
+  precision, or that can not print the type of their argument (an integer
+  for "%s", a string for "%d", "%ls" and the like) are copied as they
+  are, their arguments skipped.
+
+  Return: Length of the formatted text, or -1 with errno set to EAGAIN if
+  there is no complete record, EBADMSG if the next record is not a log
+  record, or EMSGSIZE if the text does not fit in dest, the record is not
+  consumed then.
+  */
+ssize_t
+mrb_log_decode(struct mrb *b, char *dest, size_t size, uint64_t *timestamp) {
+    const struct mrb_logfmt *fmt;
+    struct mrb_record record;
+    const unsigned char *arg;
+    unsigned char *copy = NULL;
+    const char *type;
+    const char *p;
+    char spec[32];
+    size_t total = 0;
+    char length;
+    size_t room;
+    size_t n;
+    int res;
+
+    if (mrb_recpeek(b, &record)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (!(record.flags & MRB_RECORD_LOG) || (record.size < sizeof(fmt))) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    /* The payload is walked in place, unless it wraps */
+    arg = _at(b, b->reader + MRB_RECORD_HDRSIZE);
+    if (_span(b, b->reader + MRB_RECORD_HDRSIZE, record.size) < record.size) {
+        copy = malloc(record.size);
+        if (copy == NULL) {
+            return -1;
+        }
+        _copyout(b, copy, b->reader + MRB_RECORD_HDRSIZE, record.size);
+        arg = copy;
+    }
+
+    memcpy(&fmt, arg, sizeof(fmt));
+    arg += sizeof(fmt);
+    type = fmt->types;
+
+    for (p = fmt->format; *p; p += n) {
+        if ((*p != '%') || (p[1] == '%')) {
+            n = (*p == '%')? 2: 1;
+            if ((total + 1) < size) {
+                dest[total] = *p;
+            }
+            total++;
+            continue;
+        }
+
+        /* One conversion: flags, width, precision, length, conversion */
+        n = 1 + strspn(p + 1, "-+ #0'123456789.hlLqjzt*");
+        if (p[n]) {
+            n++;
+        }
+
+        room = (total < size)? size - total: 0;
+        length = _log_length(p, n);
+        if ((*type == '\0') || (n >= sizeof(spec)) || memchr(p, '*', n) ||
+                !_log_compatible(p[n - 1], length, *type)) {
+            /* Skip the arguments it would have taken */
+            for (res = 0; (res < (int)n) && *type; res++) {
+                if ((p[res] == '*') || (res == (int)(n - 1))) {
+                    _log_skip(*type++, &arg);
+                }
+            }
+            if (room) {
+                memcpy(dest + total, p, MIN(n, room - 1));
+            }
+            total += n;
+            continue;
+        }
+
+        memcpy(spec, p, n);
+        spec[n] = '\0';
+        res = _log_format(room? dest + total: dest, room, spec, p[n - 1],
+                length, *type++, &arg);
+        if (res > 0) {
+            total += res;
+        }
+    }
+
+    free(copy);
+    if (size) {
+        dest[(total < size)? total: size - 1] = '\0';
+    }
+
+    if (total >= size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (timestamp) {
+        *timestamp = record.timestamp;
+    }
+    _record_consume(b, &record);
+    return total;
+}
+
+
+/* Every block handed out by mrb_alloc() starts with its total size, flagged
+   once freed, and the data is preceded by its distance from that start. */
+#define _ALLOC_FREE 0x80000000U
+#define _ALLOC_HDRSIZE sizeof(uint32_t)
+
+
+/* Consume freed blocks from the reader side, up to the oldest live one. */
+static void
+_alloc_reclaim(struct mrb *b) {
+    uint32_t hdr;
+
+    while (mrb_used(b) >= _ALLOC_HDRSIZE) {
+        _copyout(b, &hdr, b->reader, _ALLOC_HDRSIZE);
+        if (!(hdr & _ALLOC_FREE)) {
+            break;
+        }
+        _reader_advance(b, hdr & ~_ALLOC_FREE);
+    }
+}
+
+
+/* First offset from offset on whose address align is met. Alignment is
+   of the address, small buffers (see mrb_create_small()) start anywhere.
+   Without the mirror, padding that would reach the end of the buffer goes
+   to its start instead. */
+static size_t
+_alloc_align(struct mrb *b, size_t offset, size_t align) {
+    size_t pad = -(uintptr_t)_at(b, offset) & (align - 1);
+
+    if (_span(b, offset, pad + 1) <= pad) {
+        offset += b->size - (offset % b->size);
+        pad = -(uintptr_t)b->buff & (align - 1);
+    }
+    return offset + pad;
+}
+
+
+/** Allocate size contiguous bytes aligned to align (a power of two up to
+  the page size) from the writable region of the buffer, for objects that
+  are released in roughly the order they were allocated. Thanks to the
+  mirror a block never splits at the end of the buffer, without it (see
+  MRB_NOMIRROR) the space up to the end is skipped when needed. The
+  address of the block is aligned, whatever the buffer starts on.
+
+  The buffer must not be used for anything else meanwhile, the blocks are
+  returned to it with mrb_free() or mrb_free_oldest().
+
+  Return: The block, or NULL with errno set to EINVAL for a bad alignment or
+  ENOBUFS if there is not enough room.
+  */
+void *
+mrb_alloc(struct mrb *b, size_t size, size_t align) {
+    size_t avail = mrb_available(b);
+    size_t start = _woffset(b);
+    size_t data;
+    uint32_t hdr;
+
+    if ((align == 0) || (align & (align - 1)) ||
+            (align > (size_t)getpagesize())) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    data = _alloc_align(b, start + 2 * _ALLOC_HDRSIZE, align);
+    if (_span(b, data, size) < size) {
+        /* Would split at the end, start over at the start of the buffer */
+        data += b->size - (data % b->size);
+        data = _alloc_align(b, data, align);
+    }
+
+    if (((data - start + size) > avail) ||
+            ((data - start + size) >= _ALLOC_FREE)) {
+        errno = ENOBUFS;
+        return NULL;
+    }
+
+    hdr = data - start + size;
+    _copyin(b, start, &hdr, _ALLOC_HDRSIZE);
+    hdr = data - start;
+    _copyin(b, data - _ALLOC_HDRSIZE, &hdr, _ALLOC_HDRSIZE);
+    _writer_advance(b, data - start + size);
+    return _at(b, data);
+}
+
+
+/** Release a block allocated by mrb_alloc(). Its space is reused once all
+  the blocks allocated before it are released too.
+  */
+void
+mrb_free(struct mrb *b, void *ptr) {
+    size_t data = ((unsigned char *)ptr - b->buff) % b->size;
+    size_t start;
+    uint32_t hdr;
+
+    _copyout(b, &hdr, (data + b->size - _ALLOC_HDRSIZE) % b->size,
+            _ALLOC_HDRSIZE);
+    start = (data + b->size - hdr) % b->size;
+    _copyout(b, &hdr, start, _ALLOC_HDRSIZE);
+    hdr |= _ALLOC_FREE;
+    _copyin(b, start, &hdr, _ALLOC_HDRSIZE);
+    _alloc_reclaim(b);
+}
+
+
+/** Release the oldest block allocated by mrb_alloc() still in use.
+
+  Return: 0 on success, -1 with errno set to ENOENT if there is none.
+  */
+int
+mrb_free_oldest(struct mrb *b) {
+    uint32_t hdr;
+
+    if (mrb_used(b) < _ALLOC_HDRSIZE) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    _copyout(b, &hdr, b->reader, _ALLOC_HDRSIZE);
+    _reader_advance(b, hdr & ~_ALLOC_FREE);
+    _alloc_reclaim(b);
+    return 0;
 }
@@ -3,11 +3,109 @@
 
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+#define restrict __restrict
+extern "C" {
+#endif
 
 
 typedef struct mrb *mrb_t;
+typedef struct mrb_arena *mrb_arena_t;
+typedef void (*mrb_watermark_cb)(struct mrb *b, bool above, void *arg);
+struct epoll_event;
+
+
+/* mrb_initex() flags, see fork(2) */
+#define MRB_SHARED 0x1
+#define MRB_PRIVATE 0x2
+#define MRB_FILE 0x4
+#define MRB_NOMIRROR 0x8
+
+
+/* Most mirrors of destroyed buffers kept for reuse, see mrb_cache_limit() */
+#define MRB_CACHE_MAX 16
+
+
+/* mrb_readin_policy() policies */
+#define MRB_READIN_FIXED 0
+#define MRB_READIN_ADAPTIVE 1
+
+
+/* Maximum raw size of a block produced by mrb_compress(). */
+#define MRB_COMPRESS_BLOCKMAX 65536
+
+
+/* Header of a record written by mrb_recput(), the payload follows it. */
+struct mrb_record {
+    uint32_t size;
+    uint32_t flags;
+    uint64_t timestamp;
+};
+
+
+#define MRB_RECORD_HDRSIZE sizeof(struct mrb_record)
+
+
+/* struct mrb_record flags */
+#define MRB_RECORD_TRUNC 0x1
+#define MRB_RECORD_TSSOFT 0x2
+#define MRB_RECORD_TSHARD 0x4
+#define MRB_RECORD_LOG 0x8
+
+
+/* Maximum number of datagrams per mrb_recvmmsg()/mrb_sendmmsg() call */
+#define MRB_MMSG_MAX 64
+
+
+/* Largest datagram mrb_recvmmsg() makes room for */
+#define MRB_MMSG_DGRAMMAX 65535
+
+
+/* Descriptor of a deferred log statement, see MRB_LOG(). types holds one
+   tag per argument, as chosen by MRB_LOG_TYPE(). */
+struct mrb_logfmt {
+    const char *format;
+    const char *types;
+};
+
+
+#define MRB_LOG_TYPE(x) _Generic((x), \
+    _Bool: 'i', char: 'i', signed char: 'i', unsigned char: 'i', \
+    short: 'i', unsigned short: 'i', int: 'i', unsigned int: 'I', \
+    long: 'l', unsigned long: 'L', long long: 'q', unsigned long long: 'Q', \
+    float: 'd', double: 'd', \
+    char *: 's', const char *: 's', \
+    default: 'p')
+
+
+#define _MRB_LOG_T0()
+#define _MRB_LOG_T1(a) MRB_LOG_TYPE(a),
+#define _MRB_LOG_T2(a, ...) MRB_LOG_TYPE(a), _MRB_LOG_T1(__VA_ARGS__)
+#define _MRB_LOG_T3(a, ...) MRB_LOG_TYPE(a), _MRB_LOG_T2(__VA_ARGS__)
+#define _MRB_LOG_T4(a, ...) MRB_LOG_TYPE(a), _MRB_LOG_T3(__VA_ARGS__)
+#define _MRB_LOG_T5(a, ...) MRB_LOG_TYPE(a), _MRB_LOG_T4(__VA_ARGS__)
+#define _MRB_LOG_T6(a, ...) MRB_LOG_TYPE(a), _MRB_LOG_T5(__VA_ARGS__)
+#define _MRB_LOG_T7(a, ...) MRB_LOG_TYPE(a), _MRB_LOG_T6(__VA_ARGS__)
+#define _MRB_LOG_T8(a, ...) MRB_LOG_TYPE(a), _MRB_LOG_T7(__VA_ARGS__)
+#define _MRB_LOG_NTH(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define _MRB_LOG_TYPES(...) _MRB_LOG_NTH(_, ##__VA_ARGS__, \
+    _MRB_LOG_T8, _MRB_LOG_T7, _MRB_LOG_T6, _MRB_LOG_T5, _MRB_LOG_T4, \
+    _MRB_LOG_T3, _MRB_LOG_T2, _MRB_LOG_T1, _MRB_LOG_T0)(__VA_ARGS__)
+
+
+/* Log a printf(3) style statement (up to 8 arguments, no '*' width or
+   precision) without formatting it, see mrb_log(). C only. */
+#define MRB_LOG(b, fmt, ...) __extension__ ({ \
+    static const char _mrb_types[] = {_MRB_LOG_TYPES(__VA_ARGS__) 0}; \
+    static const struct mrb_logfmt _mrb_fmt = {fmt, _mrb_types}; \
+    mrb_log(b, &_mrb_fmt, ##__VA_ARGS__); \
+})
 
 
 int
@@ -26,6 +124,14 @@ struct mrb *
 mrb_create(size_t size);
 
 
+int
+mrb_initex(struct mrb *b, size_t size, int flags);
+
+
+struct mrb *
+mrb_createex(size_t size, int flags);
+
+
 int
 mrb_deinit(struct mrb *b);
 
@@ -34,6 +140,26 @@ int
 mrb_destroy(struct mrb *b);
 
 
+int
+mrb_cache_limit(unsigned int count);
+
+
+struct mrb *
+mrb_create_small(size_t size);
+
+
+struct mrb_arena *
+mrb_arena_create(size_t size);
+
+
+int
+mrb_arena_destroy(struct mrb_arena *a);
+
+
+struct mrb *
+mrb_arena_alloc(struct mrb_arena *a, size_t size);
+
+
 size_t
 mrb_available(struct mrb *b);
 
@@ -66,6 +192,10 @@ int
 mrb_skip(struct mrb *b, size_t size);
 
 
+bool
+mrb_ismirrored(struct mrb *b);
+
+
 size_t
 mrb_size(struct mrb *b);
 
@@ -82,6 +212,10 @@ ssize_t
 mrb_readin(struct mrb *b, int fd, size_t size);
 
 
+int
+mrb_readin_policy(struct mrb *b, int policy);
+
+
 ssize_t
 mrb_writeout(struct mrb *b, int fd, size_t size);
 
@@ -99,8 +233,229 @@ int
 mrb_vprint(struct mrb *b, const char *format, va_list args);
 
 
+FILE *
+mrb_fopen(struct mrb *b, const char *mode);
+
+
 int
 mrb_rollback(struct mrb *b, size_t size);
 
 
+const char *
+mrb_peek(struct mrb *b, size_t *size);
+
+
+uint32_t
+mrb_crc32c_update(uint32_t crc, const void *data, size_t size);
+
+
+uint64_t
+mrb_xxh64(const void *data, size_t size, uint64_t seed);
+
+
+uint32_t
+mrb_crc32c(struct mrb *b, size_t offset, size_t size);
+
+
+uint64_t
+mrb_hash(struct mrb *b, size_t offset, size_t size, uint64_t seed);
+
+
+void
+mrb_crc32c_track(struct mrb *b, bool enable);
+
+
+uint32_t
+mrb_crc32c_running(struct mrb *b);
+
+
+ssize_t
+mrb_compress(struct mrb *dst, struct mrb *src, size_t size);
+
+
+ssize_t
+mrb_decompress(struct mrb *dst, struct mrb *src);
+
+
+uint64_t
+mrb_timestamp(void);
+
+
+int
+mrb_recput(struct mrb *b, const char *restrict source, size_t size);
+
+
+int
+mrb_recputts(struct mrb *b, const char *restrict source, size_t size,
+        uint64_t timestamp);
+
+
+int
+mrb_recpeek(struct mrb *b, struct mrb_record *record);
+
+
+ssize_t
+mrb_recget(struct mrb *b, char *dest, size_t size, uint64_t *timestamp);
+
+
+size_t
+mrb_evict_older_than(struct mrb *b, uint64_t timestamp);
+
+
+int
+mrb_index_enable(struct mrb *b, size_t capacity);
+
+
+size_t
+mrb_msg_count(struct mrb *b);
+
+
+uint64_t
+mrb_msg_seq(struct mrb *b);
+
+
+const char *
+mrb_msg_find(struct mrb *b, uint64_t seq, size_t *size);
+
+
+const char *
+mrb_msg_at(struct mrb *b, size_t n, size_t *size);
+
+
+int64_t
+mrb_msg_search(struct mrb *b, uint64_t timestamp);
+
+
+uint64_t
+mrb_seq_writer(struct mrb *b);
+
+
+uint64_t
+mrb_seq_reader(struct mrb *b);
+
+
+uint64_t
+mrb_seq_tail(struct mrb *b);
+
+
+void
+mrb_retain(struct mrb *b, bool enable);
+
+
+int
+mrb_release(struct mrb *b, uint64_t seq);
+
+
+ssize_t
+mrb_read_at(struct mrb *b, uint64_t seq, char *dest, size_t size);
+
+
+char *
+mrb_reserve(struct mrb *b, size_t size);
+
+
+int
+mrb_commit(struct mrb *b, size_t size);
+
+
+int
+mrb_txbegin(struct mrb *b);
+
+
+int
+mrb_txcommit(struct mrb *b);
+
+
+int
+mrb_txabort(struct mrb *b);
+
+
+int
+mrb_putuint(struct mrb *b, uint64_t value, int base);
+
+
+int
+mrb_putint(struct mrb *b, int64_t value);
+
+
+ssize_t
+mrb_dump(struct mrb *b, int fd);
+
+
+ssize_t
+mrb_writeout_direct(struct mrb *b, int fd, size_t size);
+
+
+ssize_t
+mrb_flush_direct(struct mrb *b, int fd);
+
+
+ssize_t
+mrb_sendout(struct mrb *b, int fd, size_t size);
+
+
+int
+mrb_zerocopy_enable(struct mrb *b, int fd);
+
+
+ssize_t
+mrb_sendzc(struct mrb *b, int fd, size_t size);
+
+
+ssize_t
+mrb_zcreap(struct mrb *b, int fd);
+
+
+ssize_t
+mrb_recvmmsg(struct mrb *b, int fd, size_t max_msgs);
+
+
+ssize_t
+mrb_recvmmsgex(struct mrb *b, int fd, size_t max_msgs, size_t max_size);
+
+
+ssize_t
+mrb_sendmmsg(struct mrb *b, int fd, size_t max_msgs);
+
+
+ssize_t
+mrb_recvts(struct mrb *b, int fd, size_t size);
+
+
+int
+mrb_watermark(struct mrb *b, size_t high, size_t low,
+        mrb_watermark_cb callback, void *arg);
+
+
+int
+mrb_watermark_epoll(struct mrb *b, size_t high, size_t low, int epfd,
+        int fd, const struct epoll_event *event);
+
+
+int
+mrb_log(struct mrb *b, const struct mrb_logfmt *fmt, ...);
+
+
+ssize_t
+mrb_log_decode(struct mrb *b, char *dest, size_t size, uint64_t *timestamp);
+
+
+void *
+mrb_alloc(struct mrb *b, size_t size, size_t align);
+
+
+void
+mrb_free(struct mrb *b, void *ptr);
+
+
+int
+mrb_free_oldest(struct mrb *b);
+
+
+#ifdef __cplusplus
+}
+#undef restrict
+#endif
+
+
 #endif
@@ -0,0 +1,221 @@
+#ifndef MRB_HPP
+#define MRB_HPP
+
+
+#include "mrb.h"
+
+#include <streambuf>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#include <new>
+#endif
+
+
+/* std::streambuf over a magic ring buffer, so an std::ostream writes and an
+   std::istream reads the buffer in place.
+
+   The put area is the writable region of the buffer, contiguous thanks to
+   the mirror. What is written to it is only handed to the reader by
+   sync(), overflow() or underflow(), and nothing else must write to the
+   buffer in the meantime. Without the mirror (see MRB_NOMIRROR) there is
+   no put area and output is copied in with mrb_put().
+
+   The get area is the readable region, see mrb_peek(). Characters read
+   from it are consumed from the buffer by sync() and underflow().
+
+   The buffer is not owned, and it must outlive the streambuf. */
+class mrb_streambuf : public std::streambuf {
+public:
+    explicit
+    mrb_streambuf(struct mrb *b) : b(b) {
+    }
+
+
+    ~mrb_streambuf() {
+        sync();
+    }
+
+
+    mrb_streambuf(const mrb_streambuf &) = delete;
+    mrb_streambuf &operator=(const mrb_streambuf &) = delete;
+
+
+protected:
+    int
+    sync() override {
+        if (_commit() || _consume()) {
+            return -1;
+        }
+        return 0;
+    }
+
+
+    int_type
+    overflow(int_type c) override {
+        char ch;
+
+        if (_commit()) {
+            return traits_type::eof();
+        }
+
+        if (traits_type::eq_int_type(c, traits_type::eof())) {
+            return traits_type::not_eof(c);
+        }
+
+        ch = traits_type::to_char_type(c);
+        if (pbase() == nullptr) {
+            if (mrb_put(b, &ch, 1) != 1) {
+                return traits_type::eof();
+            }
+            return c;
+        }
+
+        if (pptr() == epptr()) {
+            return traits_type::eof();
+        }
+
+        *pptr() = ch;
+        pbump(1);
+        return c;
+    }
+
+
+    std::streamsize
+    xsputn(const char_type *s, std::streamsize n) override {
+        if ((pbase() == nullptr) && _commit()) {
+            return 0;
+        }
+
+        if (pbase() != nullptr) {
+            return std::streambuf::xsputn(s, n);
+        }
+        return mrb_put(b, s, n);
+    }
+
+
+    int_type
+    underflow() override {
+        size_t size;
+        char *data;
+
+        if (_commit() || _consume()) {
+            return traits_type::eof();
+        }
+
+        data = const_cast<char *>(mrb_peek(b, &size));
+        if (size == 0) {
+            return traits_type::eof();
+        }
+
+        setg(data, data, data + size);
+        return traits_type::to_int_type(*data);
+    }
+
+
+    std::streamsize
+    showmanyc() override {
+        size_t used = mrb_used(b) - (gptr() - eback());
+
+        if (used == 0) {
+            return -1;
+        }
+        return used;
+    }
+
+
+private:
+    struct mrb *b;
+
+
+    /* Hand what was written to the put area to the reader, then make the
+       rest of the writable region the put area. */
+    int
+    _commit() {
+        size_t avail;
+        char *p;
+
+        if (pbase() != nullptr) {
+            if (mrb_commit(b, pptr() - pbase())) {
+                return -1;
+            }
+        }
+
+        if (!mrb_ismirrored(b)) {
+            setp(nullptr, nullptr);
+            return 0;
+        }
+
+        avail = mrb_available(b);
+        p = mrb_reserve(b, avail);
+        if (p == nullptr) {
+            setp(nullptr, nullptr);
+            return -1;
+        }
+
+        setp(p, p + avail);
+        return 0;
+    }
+
+
+    /* Consume what was read from the get area, and empty it. */
+    int
+    _consume() {
+        if (eback() != nullptr) {
+            if (mrb_skip(b, gptr() - eback())) {
+                return -1;
+            }
+        }
+
+        setg(nullptr, nullptr, nullptr);
+        return 0;
+    }
+};
+
+
+#if __cplusplus >= 201703L
+/* std::pmr::memory_resource handing out blocks of a magic ring buffer with
+   mrb_alloc(), for objects released in roughly the order they were
+   allocated. A block released early is only reused once every block
+   allocated before it is released too.
+
+   The buffer is not owned, it must outlive the resource and must not be
+   used for anything else meanwhile. */
+class mrb_memory_resource : public std::pmr::memory_resource {
+public:
+    explicit
+    mrb_memory_resource(struct mrb *b) : b(b) {
+    }
+
+
+protected:
+    void *
+    do_allocate(std::size_t bytes, std::size_t alignment) override {
+        void *p = mrb_alloc(b, bytes, alignment);
+
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+
+    void
+    do_deallocate(void *p, std::size_t, std::size_t) override {
+        mrb_free(b, p);
+    }
+
+
+    bool
+    do_is_equal(const std::pmr::memory_resource &other) const noexcept
+            override {
+        return this == &other;
+    }
+
+
+private:
+    struct mrb *b;
+};
+#endif
+
+
+#endif
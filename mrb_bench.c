@@ -0,0 +1,200 @@
+#include "mrb.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+#define ROUNDS 20000
+#define BURST 64
+
+
+static uint64_t
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* Average cost of creating a ring, touching its first byte through both
+   halves of the mirror, and destroying it. */
+static void
+bench_create(const char *name, unsigned int pages, int flags) {
+    size_t size = mrb_calcsize(pages);
+    char byte;
+    uint64_t start;
+    mrb_t b;
+    int i;
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        b = mrb_createex(size, flags);
+        if (b == NULL) {
+            perror("mrb_createex");
+            return;
+        }
+        mrb_put(b, "x", 1);
+        mrb_get(b, &byte, 1);
+        mrb_destroy(b);
+    }
+
+    printf("%-24s %6u pages %8.0f ns/ring\n", name, pages,
+            (double)(now() - start) / ROUNDS);
+}
+
+
+/* Average cost of creating and destroying BURST rings at once, more than
+   the mirrors of destroyed rings kept for reuse, so most are mapped from
+   scratch. */
+static void
+bench_burst(const char *name, unsigned int pages, int flags) {
+    size_t size = mrb_calcsize(pages);
+    mrb_t rings[BURST];
+    uint64_t start;
+    int i;
+    int j;
+
+    start = now();
+    for (i = 0; i < (ROUNDS / BURST); i++) {
+        for (j = 0; j < BURST; j++) {
+            rings[j] = mrb_createex(size, flags);
+            if (rings[j] == NULL) {
+                perror("mrb_createex");
+                return;
+            }
+        }
+        for (j = 0; j < BURST; j++) {
+            mrb_destroy(rings[j]);
+        }
+    }
+
+    printf("%-24s %6u pages %8.0f ns/ring\n", name, pages,
+            (double)(now() - start) / ((ROUNDS / BURST) * BURST));
+}
+
+
+/* Bursts of rings carved from an arena, the first burst maps them, the
+   rest reuse them from the free lists. */
+static void
+bench_arena(const char *name, unsigned int pages) {
+    size_t size = mrb_calcsize(pages);
+    mrb_arena_t a = mrb_arena_create(size * BURST);
+    mrb_t rings[BURST];
+    uint64_t start;
+    int i;
+    int j;
+
+    if (a == NULL) {
+        perror("mrb_arena_create");
+        return;
+    }
+
+    start = now();
+    for (i = 0; i < (ROUNDS / BURST); i++) {
+        for (j = 0; j < BURST; j++) {
+            rings[j] = mrb_arena_alloc(a, size);
+            if (rings[j] == NULL) {
+                perror("mrb_arena_alloc");
+                return;
+            }
+        }
+        for (j = 0; j < BURST; j++) {
+            mrb_destroy(rings[j]);
+        }
+    }
+
+    printf("%-24s %6u pages %8.0f ns/ring\n", name, pages,
+            (double)(now() - start) / ((ROUNDS / BURST) * BURST));
+    mrb_arena_destroy(a);
+}
+
+
+/* Producer side cost of a log statement, formatted right away with
+   mrb_print() or deferred with MRB_LOG(). */
+static void
+bench_log(void) {
+    mrb_t b = mrb_create(mrb_calcsize(256));
+    uint64_t start;
+    int i;
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        mrb_print(b, "request %d from %s took %.3f ms\n", i, "10.0.0.1",
+                1.25);
+        mrb_skip(b, mrb_used(b));
+    }
+    printf("%-24s %8.0f ns/call\n", "mrb_print",
+            (double)(now() - start) / ROUNDS);
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        MRB_LOG(b, "request %d from %s took %.3f ms\n", i, "10.0.0.1", 1.25);
+        mrb_skip(b, mrb_used(b));
+    }
+    printf("%-24s %8.0f ns/call\n", "MRB_LOG",
+            (double)(now() - start) / ROUNDS);
+
+    mrb_destroy(b);
+}
+
+
+/* Bursts of short lived messages released in allocation order, from
+   malloc(3) or from a ring with mrb_alloc(). */
+static void
+bench_alloc(void) {
+    mrb_t b = mrb_create(mrb_calcsize(64));
+    void *messages[BURST];
+    uint64_t start;
+    int i;
+    int j;
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        for (j = 0; j < BURST; j++) {
+            messages[j] = malloc(64 + j * 16);
+            memset(messages[j], j, 64);
+        }
+        for (j = 0; j < BURST; j++) {
+            free(messages[j]);
+        }
+    }
+    printf("%-24s %8.0f ns/message\n", "malloc/free",
+            (double)(now() - start) / ((double)ROUNDS * BURST));
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        for (j = 0; j < BURST; j++) {
+            messages[j] = mrb_alloc(b, 64 + j * 16, 8);
+            memset(messages[j], j, 64);
+        }
+        for (j = 0; j < BURST; j++) {
+            mrb_free_oldest(b);
+        }
+    }
+    printf("%-24s %8.0f ns/message\n", "mrb_alloc/free_oldest",
+            (double)(now() - start) / ((double)ROUNDS * BURST));
+
+    mrb_destroy(b);
+}
+
+
+int
+main(void) {
+    unsigned int pages[] = {1, 16, 256};
+    unsigned int i;
+
+    for (i = 0; i < sizeof(pages) / sizeof(pages[0]); i++) {
+        bench_create("create/destroy", pages[i], 0);
+        bench_create("create/destroy FILE", pages[i], MRB_FILE);
+        bench_create("create/destroy NOMIRROR", pages[i], MRB_NOMIRROR);
+        bench_burst("burst", pages[i], 0);
+        bench_burst("burst FILE", pages[i], MRB_FILE);
+        bench_arena("burst arena", pages[i]);
+    }
+    bench_log();
+    bench_alloc();
+
+    return 0;
+}
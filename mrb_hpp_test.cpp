@@ -0,0 +1,193 @@
+#include "mrb.hpp"
+
+#include <cutest.h>
+#include <unistd.h>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+void
+test_mrb_streambuf_write() {
+    size_t size = mrb_calcsize(1);
+    mrb_t b = mrb_create(size);
+    size_t len;
+
+    {
+        mrb_streambuf sb(b);
+        std::ostream os(&sb);
+
+        /* Written in place, visible once flushed */
+        os << "answer " << 42 << ' ' << 1.5;
+        istrue(os.good());
+        istrue(mrb_isempty(b));
+        os.flush();
+        eqint(13, mrb_used(b));
+        eqnstr("answer 42 1.5", mrb_peek(b, &len), 13);
+
+        /* Across the end of the buffer thanks to the mirror */
+        mrb_skip(b, 13);
+        os << std::string(size - 20, 'x') << std::flush;
+        mrb_skip(b, size - 20);
+        os << "0123456789abcdefghijklmnop";
+        os.write("", 1);
+    }
+
+    /* Flushed by the destructor */
+    eqint(27, mrb_used(b));
+    eqstr("0123456789abcdefghijklmnop", mrb_peek(b, &len));
+    eqint(27, len);
+    mrb_skip(b, 27);
+
+    /* Output that does not fit fails the stream */
+    {
+        mrb_streambuf sb(b);
+        std::ostream os(&sb);
+
+        os << std::string(size - 2, 'y');
+        istrue(os.good());
+        os << "zz";
+        istrue(os.bad());
+    }
+    eqint(size - 1, mrb_used(b));
+    istrue(mrb_isfull(b));
+
+    eqint(0, mrb_destroy(b));
+}
+
+
+void
+test_mrb_streambuf_read() {
+    size_t size = mrb_calcsize(1);
+    mrb_t b = mrb_create(size);
+    std::string word;
+    int number;
+
+    {
+        mrb_streambuf sb(b);
+        std::istream is(&sb);
+
+        mrb_print(b, "hello 42 world");
+        is >> word >> number;
+        eqstr("hello", word.c_str());
+        eqint(42, number);
+
+        /* Nothing is consumed until sync() or underflow() */
+        eqint(14, mrb_used(b));
+        is.sync();
+        eqint(6, mrb_used(b));
+
+        /* End of data is end of file, clear it to read more */
+        is >> word;
+        eqstr("world", word.c_str());
+        istrue(is.eof());
+        istrue(mrb_isempty(b));
+        is.clear();
+        mrb_print(b, " again");
+        is >> word;
+        eqstr("again", word.c_str());
+    }
+    istrue(mrb_isempty(b));
+
+    /* Read back what was written through the same streambuf */
+    {
+        mrb_streambuf sb(b);
+        std::iostream ios(&sb);
+
+        ios << 7 << ' ' << "seven ";
+        ios >> number >> word;
+        eqint(7, number);
+        eqstr("seven", word.c_str());
+    }
+    eqint(1, mrb_used(b));
+
+    eqint(0, mrb_destroy(b));
+}
+
+
+void
+test_mrb_streambuf_nomirror() {
+    size_t size = mrb_calcsize(1);
+    mrb_t b = mrb_createex(size, MRB_NOMIRROR);
+    std::string word;
+    char buff[32];
+    size_t len;
+
+    {
+        mrb_streambuf sb(b);
+        std::iostream ios(&sb);
+
+        /* Copied in right away, wrapping around the end of the buffer */
+        mrb_put(b, std::string(size - 10, '.').c_str(), size - 10);
+        mrb_skip(b, size - 10);
+        ios << "wrapped around " << 123;
+        eqint(18, mrb_used(b));
+        mrb_peek(b, &len);
+        eqint(10, len);
+
+        /* The get area is read in two pieces */
+        ios >> word;
+        eqstr("wrapped", word.c_str());
+        ios >> word;
+        eqstr("around", word.c_str());
+        ios.read(buff, 4);
+        eqnstr(" 123", buff, 4);
+        ios.sync();
+    }
+    istrue(mrb_isempty(b));
+
+    eqint(0, mrb_destroy(b));
+}
+
+
+void
+test_mrb_memory_resource() {
+    size_t size = mrb_calcsize(1);
+    mrb_t b = mrb_create(size);
+    mrb_memory_resource mr(b);
+    bool thrown = false;
+    void *p;
+    int i;
+
+    /* Blocks come from the buffer */
+    p = mr.allocate(100, 64);
+    eqint(0, (uintptr_t)p % 64);
+    istrue(mrb_used(b) >= 100);
+    mr.deallocate(p, 100, 64);
+    istrue(mrb_isempty(b));
+    istrue(mr.is_equal(mr));
+
+    /* A container growing, releasing each old array after the new one */
+    {
+        std::pmr::vector<int> v(&mr);
+
+        for (i = 0; i < 500; i++) {
+            v.push_back(i);
+        }
+        eqint(499, v[499]);
+        istrue(mrb_used(b) >= (500 * sizeof(int)));
+    }
+    istrue(mrb_isempty(b));
+
+    /* Running out of room */
+    try {
+        std::pmr::vector<char> v(size, 'x', &mr);
+    }
+    catch (const std::bad_alloc &) {
+        thrown = true;
+    }
+    istrue(thrown);
+    istrue(mrb_isempty(b));
+
+    eqint(0, mrb_destroy(b));
+}
+
+
+int main() {
+    test_mrb_streambuf_write();
+    test_mrb_streambuf_read();
+    test_mrb_streambuf_nomirror();
+    test_mrb_memory_resource();
+    return EXIT_SUCCESS;
+}
@@ -4,6 +4,18 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
 
 
 static int
@@ -21,6 +33,43 @@ struct mrb {
     size_t size;
     int writer;
     int reader;
+    int flags;
+
+    int fd;
+
+    uint64_t wseq;
+    uint64_t rseq;
+    uint64_t tseq;
+    int tail;
+    bool retain;
+
+    size_t pending;
+    uint64_t msgpending;
+    bool tx;
+
+    bool crctrack;
+    uint32_t crc;
+
+    uint64_t msgwrite;
+    uint64_t msgread;
+    uint64_t *index;
+    size_t indexsize;
+    uint64_t indexhead;
+
+    int rdpolicy;
+    size_t rdsize;
+    unsigned int rdmiss;
+
+    struct mrb_zerocopy *zc;
+
+    struct mrb_watermark *wm;
+
+    struct mrb *forkprev;
+    struct mrb *forknext;
+
+    uint64_t forkepoch;
+
+    struct mrb_arena *arena;
 };
 
 
@@ -303,6 +352,1877 @@ test_mrb_skip_rollback() {
 }
 
 
+void
+test_mrb_crc32c_hash() {
+    size_t size = getpagesize();
+    mrb_t b = mrb_create(size);
+    char out[size];
+
+    eqint(0xE3069283, mrb_crc32c_update(0, "123456789", 9));
+    eqint(0xEF46DB3751D8E999, mrb_xxh64("", 0, 0));
+
+    /* Incremental checksum over everything put */
+    mrb_crc32c_track(b, true);
+    eqint(3, mrb_put(b, "xxx", 3));
+    eqint(3, mrb_get(b, out, 3));
+    mrb_crc32c_track(b, true);
+    eqint(9, mrb_put(b, "12345", 5) + mrb_put(b, "6789", 4));
+    eqint(0xE3069283, mrb_crc32c_running(b));
+
+    /* Ranges over readable data */
+    eqint(0xE3069283, mrb_crc32c(b, 0, 9));
+    eqint(mrb_crc32c_update(0, "345", 3), mrb_crc32c(b, 2, 3));
+    eqint(mrb_xxh64("123456789", 9, 7), mrb_hash(b, 0, 9, 7));
+    errno = 0;
+    eqint(0, mrb_crc32c(b, 5, 5));
+    eqint(EINVAL, errno);
+    errno = 0;
+    eqint(0, mrb_hash(b, 9, 1, 7));
+    eqint(EINVAL, errno);
+
+    /* Across the wrap point */
+    eqint(9, mrb_get(b, out, 9));
+    eqint(size - 20, mrb_put(b, out, size - 20));
+    eqint(size - 20, mrb_get(b, out, size - 20));
+    char in[64];
+    for (int i = 0; i < 64; i++) {
+        in[i] = i * 7;
+    }
+    eqint(64, mrb_put(b, in, 64));
+    istrue(b->writer < b->reader);
+    eqint(mrb_crc32c_update(0, in, 64), mrb_crc32c(b, 0, 64));
+    eqint(mrb_xxh64(in, 64, 0), mrb_hash(b, 0, 64, 0));
+    errno = 0;
+
+    mrb_destroy(b);
+}
+
+
+void
+test_mrb_compress_decompress() {
+    size_t size = getpagesize() * 16;
+    mrb_t raw = mrb_create(size);
+    mrb_t packed = mrb_create(size);
+    mrb_t unpacked = mrb_create(size);
+    char in[size];
+    char out[size];
+    int ufd = rand_open();
+    size_t i;
+
+    /* Compressible text followed by random noise */
+    for (i = 0; i < size / 2; i++) {
+        in[i] = "the quick brown fox jumps over the lazy dog "[i % 44];
+    }
+    read(ufd, in + size / 2, size / 2 - 1);
+    eqint(size - 1, mrb_put(raw, in, size - 1));
+
+    eqint(size / 2, mrb_compress(packed, raw, size / 2));
+    istrue(mrb_used(packed) < size / 8);
+    eqint(size / 2 - 1, mrb_compress(packed, raw, size));
+    istrue(mrb_isempty(raw));
+    eqint(0, mrb_compress(packed, raw, size));
+
+    eqint(size / 2, mrb_decompress(unpacked, packed));
+    eqint(size / 2 - 1, mrb_decompress(unpacked, packed));
+    eqint(0, mrb_decompress(unpacked, packed));
+    eqint(size - 1, mrb_get(unpacked, out, size));
+    istrue(memcmp(in, out, size - 1) == 0);
+
+    /* Blocks across the wrap point of both buffers */
+    for (i = 0; i < 4; i++) {
+        eqint(size / 3, mrb_put(raw, in + i * 100, size / 3));
+        eqint(size / 3, mrb_compress(packed, raw, size));
+        eqint(size / 3, mrb_decompress(unpacked, packed));
+        eqint(size / 3, mrb_get(unpacked, out, size));
+        istrue(memcmp(in + i * 100, out, size / 3) == 0);
+    }
+
+    /* Partial and corrupt blocks */
+    eqint(100, mrb_put(raw, in, 100));
+    eqint(100, mrb_compress(packed, raw, 100));
+    eqint(0, mrb_skip(packed, 1));
+    errno = 0;
+    eqint(-1, mrb_decompress(unpacked, packed));
+    eqint(EBADMSG, errno);
+    errno = 0;
+
+    /* Not enough room in the destination */
+    mrb_t tiny = mrb_create(getpagesize());
+    eqint(getpagesize() - 1, mrb_put(tiny, in, getpagesize()));
+    eqint(size / 2 - 1, mrb_put(raw, in + size / 2, size / 2 - 1));
+    eqint(20, mrb_get(tiny, out, 20));
+    eqint(-1, mrb_compress(tiny, raw, size));
+    eqint(ENOBUFS, errno);
+    eqint(80, mrb_get(tiny, out, 80));
+    eqint(75, mrb_compress(tiny, raw, size));
+    eqint(100 - 8 - 75, mrb_available(tiny));
+    eqint(-1, mrb_compress(tiny, raw, size));
+    eqint(ENOBUFS, errno);
+    errno = 0;
+
+    /* Teardown */
+    close(ufd);
+    mrb_destroy(tiny);
+    mrb_destroy(raw);
+    mrb_destroy(packed);
+    mrb_destroy(unpacked);
+}
+
+
+void
+test_mrb_records_evict() {
+    size_t size = getpagesize();
+    mrb_t b = mrb_create(size);
+    struct mrb_record record;
+    uint64_t ts;
+    char out[size];
+    int i;
+
+    istrue(mrb_timestamp() > 0);
+    eqint(-1, mrb_recget(b, out, size, &ts));
+    eqint(EAGAIN, errno);
+
+    /* Records stamped 100, 200, ... 500 */
+    for (i = 1; i <= 5; i++) {
+        eqint(0, mrb_recputts(b, "foobar", i, i * 100));
+    }
+    eqint(5 * MRB_RECORD_HDRSIZE + 15, mrb_used(b));
+
+    eqint(0, mrb_recpeek(b, &record));
+    eqint(1, record.size);
+    eqint(100, record.timestamp);
+
+    /* Evict everything older than 300 */
+    eqint(2, mrb_evict_older_than(b, 300));
+    eqint(0, mrb_evict_older_than(b, 300));
+
+    eqint(-1, mrb_recget(b, out, 2, &ts));
+    eqint(EMSGSIZE, errno);
+    errno = 0;
+    eqint(3, mrb_recget(b, out, size, &ts));
+    eqnstr("foo", out, 3);
+    eqint(300, ts);
+
+    eqint(2, mrb_evict_older_than(b, 1000));
+    istrue(mrb_isempty(b));
+
+    /* All or nothing */
+    eqint(-1, mrb_recput(b, out, size - MRB_RECORD_HDRSIZE));
+    eqint(0, mrb_recput(b, out, size - MRB_RECORD_HDRSIZE - 1));
+    istrue(mrb_isfull(b));
+
+    mrb_destroy(b);
+}
+
+
+void
+test_mrb_index() {
+    size_t size = getpagesize();
+    mrb_t b = mrb_create(size);
+    char out[size];
+    const char *msg;
+    size_t len;
+    int i;
+
+    /* Not indexed */
+    eqint(0, mrb_recput(b, "foo", 3));
+    isnull(mrb_msg_at(b, 0, &len));
+    eqint(ENOENT, errno);
+    eqint(3, mrb_recget(b, out, size, NULL));
+    errno = 0;
+
+    /* Index the last 4 records, put 6 of them */
+    eqint(0, mrb_index_enable(b, 4));
+    for (i = 0; i < 6; i++) {
+        eqint(0, mrb_recputts(b, "abcdefgh", i + 1, i * 10));
+    }
+    eqint(6, mrb_msg_count(b));
+    eqint(1, mrb_msg_seq(b));
+
+    /* The first two fell out of the index */
+    isnull(mrb_msg_at(b, 0, &len));
+    isnull(mrb_msg_at(b, 1, &len));
+    msg = mrb_msg_at(b, 2, &len);
+    isnotnull(msg);
+    eqint(3, len);
+    eqnstr("abc", msg, 3);
+    msg = mrb_msg_find(b, 6, &len);
+    eqint(6, len);
+    eqnstr("abcdef", msg, 6);
+    isnull(mrb_msg_find(b, 7, &len));
+
+    /* Binary search by timestamp */
+    eqint(5, mrb_msg_search(b, 35));
+    eqint(5, mrb_msg_search(b, 40));
+    eqint(3, mrb_msg_search(b, 0));
+    eqint(-1, mrb_msg_search(b, 51));
+
+    /* Consume records, the index follows */
+    eqint(2, mrb_evict_older_than(b, 15));
+    eqint(3, mrb_msg_seq(b));
+    msg = mrb_msg_at(b, 0, &len);
+    eqint(3, len);
+    eqint(3, mrb_recget(b, out, size, NULL));
+    eqnstr(msg, out, 3);
+    msg = mrb_msg_at(b, 2, &len);
+    eqint(6, len);
+    isnull(mrb_msg_at(b, 3, &len));
+    errno = 0;
+    mrb_destroy(b);
+
+    /* Rolling back makes the records unread again */
+    b = mrb_create(size);
+    mrb_retain(b, true);
+    eqint(0, mrb_recput(b, "old", 3));
+    eqint(3, mrb_recget(b, out, size, NULL));
+    eqint(0, mrb_index_enable(b, 2));
+    eqint(0, mrb_recput(b, "a", 1));
+    eqint(0, mrb_recput(b, "bb", 2));
+    eqint(0, mrb_recput(b, "ccc", 3));
+    for (i = 0; i < 3; i++) {
+        eqint(i + 1, mrb_recget(b, out, size, NULL));
+    }
+    eqint(0, mrb_msg_count(b));
+    eqint(0, mrb_rollback(b, MRB_RECORD_HDRSIZE + 3));
+    eqint(1, mrb_msg_count(b));
+    eqint(3, mrb_msg_seq(b));
+    msg = mrb_msg_at(b, 0, &len);
+    eqint(3, len);
+    eqnstr("ccc", msg, 3);
+    eqint(0, mrb_rollback(b, MRB_RECORD_HDRSIZE + 2));
+    eqint(2, mrb_msg_count(b));
+    msg = mrb_msg_at(b, 0, &len);
+    eqint(2, len);
+    eqnstr("bb", msg, 2);
+
+    /* Not into records older than the index */
+    eqint(-1, mrb_rollback(b, 1));
+    eqint(ERANGE, errno);
+    errno = 0;
+    eqint(2, mrb_msg_count(b));
+    eqint(2, mrb_recget(b, out, size, NULL));
+    eqnstr("bb", out, 2);
+    eqint(1, mrb_msg_count(b));
+
+    mrb_destroy(b);
+}
+
+
+void
+test_mrb_seq_retain_read_at() {
+    size_t size = getpagesize();
+    mrb_t b = mrb_create(size);
+    char out[size];
+    size_t len;
+
+    eqint(9, mrb_put(b, "foobarbaz", 9));
+    eqint(3, mrb_get(b, out, 3));
+    eqint(9, mrb_seq_writer(b));
+    eqint(3, mrb_seq_reader(b));
+    eqint(3, mrb_seq_tail(b));
+
+    /* Consumed data is gone without retention */
+    eqint(-1, mrb_read_at(b, 0, out, 3));
+    eqint(ERANGE, errno);
+    eqint(3, mrb_read_at(b, 3, out, 3));
+    eqnstr("bar", out, 3);
+
+    /* Retain what is sent until it is acknowledged */
+    mrb_retain(b, true);
+    eqint(6, mrb_get(b, out, 6));
+    istrue(mrb_isempty(b));
+    eqint(3, mrb_seq_tail(b));
+    eqint(size - 7, mrb_available(b));
+    eqint(6, mrb_read_at(b, 3, out, size));
+    eqnstr("barbaz", out, 6);
+    eqint(0, mrb_read_at(b, 9, out, size));
+    eqint(-1, mrb_read_at(b, 10, out, size));
+
+    /* Retained data is never overwritten */
+    eqint(size - 7, mrb_put(b, out, size));
+    istrue(mrb_isfull(b));
+    eqint(3, mrb_read_at(b, 6, out, 3));
+    eqnstr("baz", out, 3);
+
+    /* Acknowledge up to 6 */
+    eqint(-1, mrb_release(b, 2));
+    eqint(-1, mrb_release(b, 10));
+    eqint(0, mrb_release(b, 6));
+    eqint(6, mrb_seq_tail(b));
+    eqint(3, mrb_available(b));
+    eqint(-1, mrb_read_at(b, 5, out, 1));
+    errno = 0;
+
+    /* Records stay reachable by sequence number while retained */
+    mrb_retain(b, false);
+    eqint(size - 1, mrb_used(b) + mrb_available(b));
+    eqint(size - 7, mrb_get(b, out, size));
+    eqint(0, mrb_index_enable(b, 8));
+    mrb_retain(b, true);
+    eqint(0, mrb_recput(b, "qux", 3));
+    eqint(3, mrb_recget(b, out, size, NULL));
+    isnotnull(mrb_msg_find(b, 0, &len));
+    eqint(3, len);
+    eqint(0, mrb_release(b, mrb_seq_reader(b)));
+    isnull(mrb_msg_find(b, 0, &len));
+    errno = 0;
+
+    mrb_destroy(b);
+}
+
+
+void
+test_mrb_rollback_retained() {
+    size_t size = getpagesize();
+    mrb_t b = mrb_create(size);
+    char in[size];
+    char out[size];
+    const char *p;
+    size_t len;
+
+    /* Nothing consumed yet */
+    eqint(-1, mrb_rollback(b, 1));
+    eqint(ERANGE, errno);
+    eqint(0, mrb_rollback(b, 0));
+
+    /* Without retention, overwritten data can not be restored */
+    memset(in, 'x', size);
+    eqint(100, mrb_put(b, in, 100));
+    eqint(100, mrb_get(b, out, 100));
+    eqint(size - 50, mrb_put(b, in, size - 50));
+    eqint(49, mrb_available(b));
+    eqint(-1, mrb_rollback(b, 50));
+    eqint(0, mrb_rollback(b, 49));
+    eqint(size - 1, mrb_used(b));
+    eqint(size - 1, mrb_get(b, out, size));
+
+    /* Speculative parsing over retained history */
+    mrb_retain(b, true);
+    eqint(12, mrb_put(b, "HEAD:foo\r\nba", 12));
+    p = mrb_peek(b, &len);
+    eqint(12, len);
+    eqnstr("HEAD:", p, 5);
+    eqint(5, mrb_get(b, out, 5));
+    eqint(5, mrb_get(b, out, 5));
+
+    /* Incomplete, rewind and wait for more data */
+    eqint(-1, mrb_rollback(b, 11));
+    eqint(0, mrb_rollback(b, 10));
+    eqint(12, mrb_used(b));
+
+    /* The writer can not overwrite the rewindable history */
+    eqint(5, mrb_get(b, out, 5));
+    eqint(size - 13, mrb_put(b, in, size));
+    eqint(0, mrb_rollback(b, 5));
+    p = mrb_peek(b, &len);
+    eqnstr("HEAD:", p, 5);
+
+    /* Done parsing, release the history */
+    eqint(0, mrb_skip(b, len));
+    eqint(0, mrb_release(b, mrb_seq_reader(b)));
+    eqint(-1, mrb_rollback(b, 1));
+    eqint(size - 1, mrb_available(b));
+    errno = 0;
+
+    mrb_destroy(b);
+}
+
+
+void
+test_mrb_reserve_commit_tx() {
+    size_t size = getpagesize();
+    mrb_t b = mrb_create(size);
+    char out[size];
+    char *p;
+    size_t len;
+
+    /* Reserve, fill in place, commit */
+    p = mrb_reserve(b, 3);
+    isnotnull(p);
+    memcpy(p, "foo", 3);
+    eqint(0, mrb_used(b));
+    eqint(0, mrb_commit(b, 3));
+    eqint(3, mrb_used(b));
+    isnull(mrb_reserve(b, size));
+    eqint(ENOBUFS, errno);
+    eqint(-1, mrb_commit(b, size));
+    errno = 0;
+
+    /* Header and body become visible at once */
+    mrb_crc32c_track(b, true);
+    eqint(0, mrb_txbegin(b));
+    eqint(-1, mrb_txbegin(b));
+    eqint(EBUSY, errno);
+    eqint(4, mrb_put(b, "HDR:", 4));
+    eqint(7, mrb_print(b, "body %d", 42));
+    eqint(0, mrb_recput(b, "rec", 3));
+    eqint(3, mrb_used(b));
+    eqint(0, mrb_msg_count(b));
+    eqint(size - 1 - 3 - 11 - 3 - MRB_RECORD_HDRSIZE, mrb_available(b));
+    eqint(0, mrb_crc32c_running(b));
+    eqint(0, mrb_txcommit(b));
+    eqint(3 + 11 + MRB_RECORD_HDRSIZE + 3, mrb_used(b));
+    eqint(1, mrb_msg_count(b));
+    eqint(mrb_crc32c(b, 3, 11 + MRB_RECORD_HDRSIZE + 3),
+            mrb_crc32c_running(b));
+    eqint(-1, mrb_txcommit(b));
+    eqint(EINVAL, errno);
+    errno = 0;
+
+    eqint(14, mrb_get(b, out, 14));
+    eqnstr("fooHDR:body 42", out, 14);
+    eqint(3, mrb_recget(b, out, size, NULL));
+    eqnstr("rec", out, 3);
+
+    /* Aborted writes never show up */
+    eqint(0, mrb_index_enable(b, 4));
+    eqint(0, mrb_recput(b, "one", 3));
+    eqint(0, mrb_txbegin(b));
+    eqint(0, mrb_recput(b, "two", 3));
+    p = mrb_reserve(b, 5);
+    memcpy(p, "three", 5);
+    eqint(0, mrb_commit(b, 5));
+    eqint(0, mrb_txabort(b));
+    eqint(-1, mrb_txabort(b));
+    errno = 0;
+    eqint(MRB_RECORD_HDRSIZE + 3, mrb_used(b));
+    eqint(1, mrb_msg_count(b));
+    isnull(mrb_msg_at(b, 1, &len));
+    eqint(0, mrb_recput(b, "four", 4));
+    eqnstr("four", mrb_msg_at(b, 1, &len), 4);
+    eqint(3, mrb_recget(b, out, size, NULL));
+    eqnstr("one", out, 3);
+    eqint(4, mrb_recget(b, out, size, NULL));
+    eqnstr("four", out, 4);
+    istrue(mrb_isempty(b));
+
+    /* Uncommitted data fills the buffer too */
+    eqint(0, mrb_txbegin(b));
+    eqint(size - 1, mrb_put(b, out, size));
+    istrue(mrb_isempty(b));
+    istrue(mrb_isfull(b));
+    eqint(0, mrb_txabort(b));
+    isfalse(mrb_isfull(b));
+
+    /* Print does not truncate */
+    eqint(size - 9, mrb_put(b, out, size - 9));
+    eqint(-1, mrb_print(b, "%s", "foobarbaz"));
+    eqint(ENOBUFS, errno);
+    eqint(7, mrb_print(b, "%s", "foobarb"));
+    errno = 0;
+
+    mrb_destroy(b);
+}
+
+
+static mrb_t crashlog;
+
+
+static void
+crash_handler(int sig) {
+    mrb_putall(crashlog, "signal ", 7);
+    mrb_putint(crashlog, sig);
+    mrb_putall(crashlog, " at 0x", 6);
+    mrb_putuint(crashlog, 0xdeadbeef, 16);
+    mrb_putall(crashlog, "\n", 1);
+}
+
+
+void
+test_mrb_signalsafe_dump() {
+    size_t size = getpagesize();
+    char out[size];
+    struct tfile dumpfile = tmpfile_open();
+    crashlog = mrb_create(size);
+
+    eqint(0, mrb_putint(crashlog, 0));
+    eqint(0, mrb_putint(crashlog, -9223372036854775807LL - 1));
+    eqint(0, mrb_putuint(crashlog, 18446744073709551615ULL, 10));
+    eqint(0, mrb_putuint(crashlog, 5, 2));
+    eqint(-1, mrb_putuint(crashlog, 5, 17));
+    eqint(EINVAL, errno);
+    errno = 0;
+    eqint(1 + 20 + 20 + 3, mrb_get(crashlog, out, size));
+    eqnstr("0-9223372036854775808184467440737095516151010", out, 44);
+
+    /* Trace from a signal handler, then dump without consuming */
+    mrb_retain(crashlog, true);
+    eqint(4, mrb_put(crashlog, "old\n", 4));
+    eqint(4, mrb_get(crashlog, out, 4));
+    signal(SIGUSR1, crash_handler);
+    raise(SIGUSR1);
+    signal(SIGUSR1, SIG_DFL);
+    eqint(24, mrb_used(crashlog));
+    eqint(28, mrb_dump(crashlog, dumpfile.fd));
+    eqint(24, mrb_used(crashlog));
+
+    lseek(dumpfile.fd, 0, SEEK_SET);
+    eqint(28, read(dumpfile.fd, out, size));
+    eqnstr("old\nsignal 10 at 0xdeadbeef\n", out, 28);
+
+    fclose(dumpfile.file);
+    mrb_destroy(crashlog);
+}
+
+
+void
+test_mrb_fork_shared() {
+    size_t size = getpagesize();
+    mrb_t b = mrb_createex(size, MRB_SHARED);
+    unsigned char chunk[100];
+    size_t total = size * 64;
+    size_t i;
+    size_t got = 0;
+    int status;
+    pid_t pid;
+
+    isnotnull(b);
+    eqint(-1, mrb_index_enable(b, 4));
+    isnull(mrb_createex(size, MRB_SHARED | MRB_PRIVATE));
+    errno = 0;
+
+    /* Child produces, parent consumes, concurrently */
+    pid = fork();
+    if (pid == 0) {
+        for (i = 0; i < total;) {
+            chunk[0] = i % 251;
+            if (mrb_putall(b, (char *)chunk, 1) == 0) {
+                i++;
+            }
+        }
+        _exit(0);
+    }
+
+    while (got < total) {
+        size_t n = mrb_get(b, (char *)chunk, sizeof(chunk));
+        for (i = 0; i < n; i++) {
+            eqint((got + i) % 251, chunk[i]);
+        }
+        got += n;
+    }
+
+    eqint(pid, waitpid(pid, &status, 0));
+    eqint(0, WEXITSTATUS(status));
+    istrue(mrb_isempty(b));
+    eqint(total, mrb_seq_reader(b));
+    eqint(0, mrb_destroy(b));
+}
+
+
+void
+test_mrb_fork_private() {
+    size_t size = getpagesize();
+    mrb_t b = mrb_createex(size, MRB_PRIVATE);
+    mrb_t other = mrb_createex(size, MRB_PRIVATE);
+    char out[size];
+    int status;
+    pid_t pid;
+
+    eqint(3, mrb_put(b, "foo", 3));
+    mrb_destroy(other);
+
+    pid = fork();
+    if (pid == 0) {
+        /* The child starts with a copy of the parent's buffer */
+        if ((mrb_get(b, out, size) != 3) || memcmp(out, "foo", 3)) {
+            _exit(1);
+        }
+        memcpy(b->buff, "bar", 3);
+        mrb_put(b, "barbaz", 6);
+        _exit(0);
+    }
+
+    eqint(pid, waitpid(pid, &status, 0));
+    eqint(0, WEXITSTATUS(status));
+
+    /* Nothing the child did shows up here */
+    eqnstr("foo", (char *)b->buff, 3);
+    eqint(3, mrb_used(b));
+    eqint(3, mrb_put(b, "qux", 3));
+    eqint(6, mrb_get(b, out, size));
+    eqnstr("fooqux", out, 6);
+    eqint(0, mrb_destroy(b));
+}
+
+
+void
+test_mrb_writeout_direct() {
+    size_t pagesize = getpagesize();
+    size_t size = pagesize * 4;
+    mrb_t b = mrb_create(size);
+    char in[size * 2];
+    char out[size * 2];
+    char path[] = "/var/tmp/mrb_test_XXXXXX";
+    int ufd = rand_open();
+    int fd;
+
+    /* O_DIRECT when the filesystem supports it */
+    fd = mkstemp(path);
+    istrue(fd >= 0);
+    close(fd);
+    fd = open(path, O_RDWR | O_DIRECT);
+    if (fd < 0) {
+        fd = open(path, O_RDWR);
+    }
+    istrue(fd >= 0);
+
+    read(ufd, in, size * 2);
+    eqint(pagesize - 10, mrb_put(b, in, pagesize - 10));
+
+    /* Less than a page is held back */
+    eqint(0, mrb_writeout_direct(b, fd, size));
+    eqint(pagesize - 10, mrb_used(b));
+
+    eqint(pagesize * 2, mrb_put(b, in + pagesize - 10, pagesize * 2));
+    eqint(pagesize * 2, mrb_writeout_direct(b, fd, size));
+    eqint(pagesize - 10, mrb_used(b));
+    eqint(pagesize * 2, lseek(fd, 0, SEEK_CUR));
+
+    /* Across the wrap point */
+    eqint(pagesize * 2, mrb_put(b, in + pagesize * 3 - 10, pagesize * 2));
+    istrue(b->writer < b->reader);
+    eqint(pagesize * 2, mrb_writeout_direct(b, fd, size));
+
+    /* Unaligned reader */
+    eqint(0, mrb_skip(b, 1));
+    eqint(-1, mrb_writeout_direct(b, fd, size));
+    eqint(EINVAL, errno);
+    errno = 0;
+    eqint(0, mrb_rollback(b, 1));
+
+    /* Flush the tail, the file is truncated to the real length */
+    eqint(pagesize - 10, mrb_flush_direct(b, fd));
+    istrue(mrb_isempty(b));
+    eqint(pagesize * 5 - 10, lseek(fd, 0, SEEK_END));
+    close(fd);
+
+    fd = open(path, O_RDONLY);
+    eqint(pagesize * 5 - 10, read(fd, out, size * 2));
+    istrue(memcmp(in, out, pagesize * 5 - 10) == 0);
+
+    /* Teardown */
+    close(fd);
+    unlink(path);
+    close(ufd);
+    mrb_destroy(b);
+}
+
+
+void
+test_mrb_sendout() {
+    size_t size = getpagesize();
+    mrb_t b = mrb_createex(size, MRB_FILE);
+    mrb_t nofile = mrb_create(size);
+    char in[size];
+    char out[size];
+    int ufd = rand_open();
+    int sv[2];
+
+    isnotnull(b);
+    eqint(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    read(ufd, in, size);
+
+    eqint(100, mrb_put(b, in, 100));
+    eqint(60, mrb_sendout(b, sv[0], 60));
+    eqint(40, mrb_used(b));
+    eqint(60, read(sv[1], out, size));
+    istrue(memcmp(in, out, 60) == 0);
+
+    /* Across the wrap point, in two sendfile(2) calls */
+    eqint(0, mrb_skip(b, 40));
+    eqint(size - 1, mrb_put(b, in, size - 1));
+    istrue(b->writer < b->reader);
+    eqint(size - 1, mrb_sendout(b, sv[0], size));
+    istrue(mrb_isempty(b));
+    eqint(size - 1, recv(sv[1], out, size - 1, MSG_WAITALL));
+    istrue(memcmp(in, out, size - 1) == 0);
+
+    /* Without a backing file */
+    eqint(5, mrb_put(nofile, "hello", 5));
+    eqint(5, mrb_sendout(nofile, sv[0], size));
+    eqint(5, read(sv[1], out, size));
+    eqnstr("hello", out, 5);
+
+    /* Teardown */
+    close(sv[0]);
+    close(sv[1]);
+    close(ufd);
+    mrb_destroy(nofile);
+    mrb_destroy(b);
+}
+
+
+static int
+tcp_pair(int *client, int *server) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addrlen = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    if ((listener < 0) ||
+            bind(listener, (struct sockaddr *)&addr, sizeof(addr)) ||
+            listen(listener, 1) ||
+            getsockname(listener, (struct sockaddr *)&addr, &addrlen)) {
+        return -1;
+    }
+
+    *client = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*client, (struct sockaddr *)&addr, sizeof(addr))) {
+        return -1;
+    }
+    *server = accept(listener, NULL, NULL);
+    close(listener);
+    return *server < 0? -1: 0;
+}
+
+
+void
+test_mrb_sendzc() {
+    size_t size = getpagesize() * 4;
+    mrb_t b = mrb_create(size);
+    mrb_t s = mrb_createex(size, MRB_SHARED);
+    char in[size];
+    char out[size];
+    int ufd = rand_open();
+    int client;
+    int server;
+    int i;
+
+    eqint(0, tcp_pair(&client, &server));
+    eqint(-1, mrb_sendzc(b, client, size));
+    eqint(EINVAL, errno);
+    errno = 0;
+
+    /* Not across processes */
+    eqint(-1, mrb_zerocopy_enable(s, client));
+    eqint(EINVAL, errno);
+    errno = 0;
+    eqint(0, mrb_destroy(s));
+    if (mrb_zerocopy_enable(b, client)) {
+        /* Kernel without SO_ZEROCOPY */
+        errno = 0;
+        goto teardown;
+    }
+
+    read(ufd, in, size);
+    eqint(size - 1, mrb_put(b, in, size - 1));
+    eqint(1000, mrb_sendzc(b, client, 1000));
+    eqint(size - 1001, mrb_sendzc(b, client, size));
+    istrue(mrb_isempty(b));
+
+    /* Nothing is reclaimed until the kernel is done */
+    eqint(0, mrb_available(b));
+    eqint(size - 1, recv(server, out, size - 1, MSG_WAITALL));
+    istrue(memcmp(in, out, size - 1) == 0);
+
+    for (i = 0; (mrb_zcreap(b, client) > 0) && (i < 100); i++) {
+        struct pollfd pfd = {.fd = client, .events = 0};
+        poll(&pfd, 1, 10);
+    }
+    eqint(0, mrb_zcreap(b, client));
+    eqint(size - 1, mrb_available(b));
+    eqint(mrb_seq_reader(b), mrb_seq_tail(b));
+
+teardown:
+    close(client);
+    close(server);
+    close(ufd);
+    mrb_destroy(b);
+}
+
+
+void
+test_mrb_recvmmsg_sendmmsg() {
+    size_t size = getpagesize();
+    mrb_t b = mrb_create(size);
+    struct mrb_record record;
+    char out[size];
+    char big[100];
+    char mtu[1400];
+    int sv[2];
+    int i;
+
+    eqint(0, socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, sv));
+    eqint(3, send(sv[1], "foo", 3, 0));
+    eqint(6, send(sv[1], "barbaz", 6, 0));
+    eqint(0, send(sv[1], "", 0, 0));
+    eqint(3, send(sv[1], "qux", 3, 0));
+
+    /* Everything in one call, packed as records */
+    eqint(4, mrb_recvmmsgex(b, sv[0], 16, 64));
+    eqint(4 * MRB_RECORD_HDRSIZE + 12, mrb_used(b));
+    eqint(4, mrb_msg_count(b));
+    eqint(3, mrb_recget(b, out, size, NULL));
+    eqnstr("foo", out, 3);
+    eqint(6, mrb_recget(b, out, size, NULL));
+    eqnstr("barbaz", out, 6);
+    eqint(0, mrb_recget(b, out, size, NULL));
+    eqint(3, mrb_recget(b, out, size, NULL));
+    eqnstr("qux", out, 3);
+
+    /* Nothing to receive */
+    eqint(-1, mrb_recvmmsg(b, sv[0], 16));
+    eqint(EAGAIN, errno);
+    errno = 0;
+
+    /* Datagrams larger than max_size are truncated */
+    memset(big, 'x', sizeof(big));
+    eqint(100, send(sv[1], big, 100, 0));
+    eqint(100, send(sv[1], big, 100, 0));
+    eqint(1, mrb_recvmmsgex(b, sv[0], 1, 60));
+    eqint(0, mrb_recpeek(b, &record));
+    eqint(MRB_RECORD_TRUNC, record.flags);
+    eqint(60, record.size);
+    eqint(60, mrb_recget(b, out, size, NULL));
+
+    /* Less room than max_size, one datagram gets all of it */
+    eqint(1, mrb_recvmmsg(b, sv[0], MRB_MMSG_MAX));
+    eqint(0, mrb_recpeek(b, &record));
+    eqint(0, record.flags);
+    eqint(100, mrb_recget(b, out, size, NULL));
+
+    /* Send records out, one datagram each */
+    eqint(0, mrb_recput(b, "one", 3));
+    eqint(0, mrb_recput(b, "two", 3));
+    eqint(0, mrb_recput(b, "three", 5));
+    eqint(2, mrb_sendmmsg(b, sv[0], 2));
+    eqint(1, mrb_msg_count(b));
+    eqint(3, recv(sv[1], out, size, 0));
+    eqnstr("one", out, 3);
+    eqint(3, recv(sv[1], out, size, 0));
+    eqnstr("two", out, 3);
+    eqint(1, mrb_sendmmsg(b, sv[0], 16));
+    eqint(5, recv(sv[1], out, size, 0));
+    eqnstr("three", out, 5);
+    eqint(0, mrb_sendmmsg(b, sv[0], 16));
+    istrue(mrb_isempty(b));
+
+    close(sv[0]);
+    close(sv[1]);
+    mrb_destroy(b);
+
+    /* A full MTU datagram while many slots are offered */
+    b = mrb_create(mrb_calcsize(16));
+
+    eqint(0, socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, sv));
+    memset(mtu, 'm', sizeof(mtu));
+    eqint(1400, send(sv[1], mtu, 1400, 0));
+    eqint(1, mrb_recvmmsg(b, sv[0], MRB_MMSG_MAX));
+    eqint(0, mrb_recpeek(b, &record));
+    eqint(0, record.flags);
+    eqint(1400, record.size);
+    eqint(1400, mrb_recget(b, out, sizeof(out), NULL));
+    eqnstr(mtu, out, 1400);
+
+    /* Batches of them with a caller chosen max_size */
+    for (i = 0; i < 30; i++) {
+        eqint(1400, send(sv[1], mtu, 1400, 0));
+    }
+    eqint(30, mrb_recvmmsgex(b, sv[0], MRB_MMSG_MAX, 1500));
+    for (i = 0; i < 30; i++) {
+        eqint(0, mrb_recpeek(b, &record));
+        eqint(0, record.flags);
+        eqint(1400, mrb_recget(b, out, sizeof(out), NULL));
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    mrb_destroy(b);
+}
+
+
+void
+test_mrb_recvts() {
+    size_t size = getpagesize();
+    mrb_t b = mrb_create(size);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addrlen = sizeof(addr);
+    struct mrb_record record;
+    struct timespec now;
+    uint64_t ts;
+    char out[size];
+    int tsflags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    int rx = socket(AF_INET, SOCK_DGRAM, 0);
+    int tx = socket(AF_INET, SOCK_DGRAM, 0);
+    int i;
+
+    eqint(0, bind(rx, (struct sockaddr *)&addr, sizeof(addr)));
+    eqint(0, getsockname(rx, (struct sockaddr *)&addr, &addrlen));
+    eqint(0, connect(tx, (struct sockaddr *)&addr, sizeof(addr)));
+
+    /* Without kernel timestamps, stamped in the same clock */
+    clock_gettime(CLOCK_REALTIME, &now);
+    eqint(3, send(tx, "foo", 3, 0));
+    eqint(3, mrb_recvts(b, rx, size));
+    eqint(0, mrb_recpeek(b, &record));
+    eqint(0, record.flags);
+    eqint(3, mrb_recget(b, out, size, &ts));
+    istrue(ts >= now.tv_sec * 1000000000ULL + now.tv_nsec);
+    istrue(ts < (now.tv_sec + 10) * 1000000000ULL);
+
+    /* Software receive timestamps, the kernel turns them on
+       asynchronously so the first datagrams might not be stamped yet */
+    eqint(0, setsockopt(rx, SOL_SOCKET, SO_TIMESTAMPING, &tsflags,
+                sizeof(tsflags)));
+    for (i = 0; i < 100; i++) {
+        eqint(4, send(tx, "warm", 4, 0));
+        eqint(4, mrb_recvts(b, rx, size));
+        eqint(0, mrb_recpeek(b, &record));
+        eqint(4, mrb_recget(b, out, size, NULL));
+        if (record.flags == MRB_RECORD_TSSOFT) {
+            break;
+        }
+        usleep(1000);
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    eqint(6, send(tx, "barbaz", 6, 0));
+    eqint(6, mrb_recvts(b, rx, size));
+    eqint(0, mrb_recpeek(b, &record));
+    eqint(MRB_RECORD_TSSOFT, record.flags);
+    eqint(6, mrb_recget(b, out, size, &ts));
+    eqnstr("barbaz", out, 6);
+    istrue(ts >= now.tv_sec * 1000000000ULL + now.tv_nsec);
+    istrue(ts < (now.tv_sec + 10) * 1000000000ULL);
+
+    /* Truncated */
+    eqint(6, send(tx, "barbaz", 6, 0));
+    eqint(2, mrb_recvts(b, rx, 2));
+    eqint(0, mrb_recpeek(b, &record));
+    eqint(MRB_RECORD_TSSOFT | MRB_RECORD_TRUNC, record.flags);
+
+    close(rx);
+    close(tx);
+    mrb_destroy(b);
+}
+
+
+void
+test_mrb_readin_adaptive() {
+    size_t pagesize = getpagesize();
+    size_t size = pagesize * 16;
+    mrb_t b = mrb_create(size);
+    char in[size];
+    char out[size];
+    int ufd = rand_open();
+    int p[2];
+    int i;
+
+    eqint(0, pipe2(p, O_NONBLOCK));
+    read(ufd, in, size);
+    eqint(-1, mrb_readin_policy(b, 7));
+    eqint(EINVAL, errno);
+    errno = 0;
+    eqint(0, mrb_readin_policy(b, MRB_READIN_ADAPTIVE));
+    eqint(pagesize, b->rdsize);
+
+    /* Nothing there */
+    eqint(-1, mrb_readin(b, p[0], size));
+    eqint(EAGAIN, errno);
+    errno = 0;
+
+    /* A burst is drained in one call with growing reads */
+    eqint(pagesize * 7, write(p[1], in, pagesize * 7));
+    eqint(pagesize * 7, mrb_readin(b, p[0], size));
+    eqint(pagesize * 8, b->rdsize);
+    eqint(32, b->rdmiss);
+    eqint(pagesize * 7, mrb_get(b, out, size));
+    istrue(memcmp(in, out, pagesize * 7) == 0);
+
+    /* The upper bound still holds */
+    eqint(pagesize * 2, write(p[1], in, pagesize * 2));
+    eqint(100, mrb_readin(b, p[0], 100));
+    eqint(pagesize * 2 - 100, mrb_readin(b, p[0], size));
+    eqint(pagesize * 2, mrb_get(b, out, size));
+
+    /* Small messages shrink the reads */
+    for (i = 0; i < 4; i++) {
+        eqint(10, write(p[1], in, 10));
+        eqint(10, mrb_readin(b, p[0], size));
+    }
+    eqint(pagesize, b->rdsize);
+
+    /* Extra reads that keep finding nothing are not tried any more */
+    for (i = 0; i < 10; i++) {
+        eqint(pagesize, write(p[1], in, pagesize));
+        eqint(pagesize, mrb_readin(b, p[0], size));
+        mrb_skip(b, pagesize);
+        b->rdsize = pagesize;
+    }
+    istrue(b->rdmiss > 128);
+
+    /* But they are tried again once in a while */
+    for (i = 0; (i < 20) && (b->rdmiss > 128); i++) {
+        eqint(pagesize, write(p[1], in, pagesize));
+        eqint(pagesize, mrb_readin(b, p[0], size));
+        mrb_skip(b, pagesize);
+        b->rdsize = pagesize;
+    }
+    istrue(b->rdmiss <= 128);
+    eqint(pagesize * 2, write(p[1], in, pagesize * 2));
+    eqint(pagesize * 2, mrb_readin(b, p[0], size));
+    mrb_skip(b, pagesize * 2);
+
+    /* Fixed policy reads once */
+    eqint(0, mrb_readin_policy(b, MRB_READIN_FIXED));
+    eqint(pagesize * 3, write(p[1], in, pagesize * 3));
+    eqint(pagesize, mrb_readin(b, p[0], pagesize));
+
+    close(p[0]);
+    close(p[1]);
+    close(ufd);
+    mrb_destroy(b);
+}
+
+
+/* Move the writer and reader of an empty buffer to offset. */
+static void
+nomirror_seek(mrb_t b, int offset) {
+    char tmp[b->size];
+    size_t amount = (offset - b->writer + b->size) % b->size;
+
+    memset(tmp, 0, amount);
+    mrb_put(b, tmp, amount);
+    mrb_get(b, tmp, amount);
+}
+
+
+void
+test_mrb_nomirror() {
+    size_t size = mrb_calcsize(1);
+    mrb_t b = mrb_createex(size, MRB_NOMIRROR);
+    mrb_t c = mrb_createex(size, MRB_NOMIRROR);
+    mrb_t d = mrb_createex(size, MRB_NOMIRROR);
+    mrb_t m = mrb_create(size);
+    const char *text = "a line long enough to wrap around";
+    char in[size];
+    char out[size];
+    size_t len;
+    int ufd = rand_open();
+    int p[2];
+    int i;
+
+    isnotnull(b);
+    isfalse(mrb_ismirrored(b));
+    istrue(mrb_ismirrored(m));
+    read(ufd, in, size);
+
+    /* Reserve only reaches the end of the buffer */
+    nomirror_seek(b, size - 100);
+    isnull(mrb_reserve(b, 200));
+    eqint(ENOBUFS, errno);
+    errno = 0;
+    isnotnull(mrb_reserve(b, 100));
+
+    /* Copies are split where the data wraps */
+    eqint(300, mrb_put(b, in, 300));
+    eqint(200, b->writer);
+    istrue(mrb_peek(b, &len) == (const char *)b->buff + size - 100);
+    eqint(100, len);
+    eqint(mrb_crc32c_update(0, (unsigned char *)in, 300), mrb_crc32c(b, 0, 300));
+    eqint(mrb_xxh64(in + 50, 200, 7), mrb_hash(b, 50, 200, 7));
+    eqint(95, mrb_search(b, in + 95, 10, 0, 0));
+    eqint(150, mrb_softget(b, out, 150, 50));
+    istrue(memcmp(in + 50, out, 150) == 0);
+    eqint(300, mrb_get(b, out, 300));
+    istrue(memcmp(in, out, 300) == 0);
+    eqint(0, mrb_rollback(b, 300));
+    eqint(300, mrb_getmin(b, out, 300, size));
+    istrue(memcmp(in, out, 300) == 0);
+
+    /* Records, the header wraps first, then the payload */
+    eqint(0, mrb_index_enable(b, 8));
+    nomirror_seek(b, size - 10);
+    eqint(0, mrb_recput(b, in, 50));
+    isnotnull(mrb_msg_find(b, 0, &len));
+    eqint(50, len);
+    eqint(50, mrb_recget(b, out, size, NULL));
+    istrue(memcmp(in, out, 50) == 0);
+    nomirror_seek(b, size - 20);
+    eqint(0, mrb_recput(b, in, 50));
+    isnull(mrb_msg_find(b, 1, &len));
+    eqint(ERANGE, errno);
+    errno = 0;
+    eqint(50, mrb_recget(b, out, size, NULL));
+    istrue(memcmp(in, out, 50) == 0);
+
+    /* I/O stops at the end of the buffer, or takes two iovecs */
+    eqint(0, pipe(p));
+    nomirror_seek(b, size - 100);
+    eqint(300, write(p[1], in, 300));
+    eqint(100, mrb_readin(b, p[0], 300));
+    eqint(200, mrb_readin(b, p[0], 300));
+    eqint(300, mrb_writeout(b, p[1], 300));
+    eqint(300, read(p[0], out, 300));
+    istrue(memcmp(in, out, 300) == 0);
+
+    /* Formatting past the end goes through a copy */
+    nomirror_seek(b, size - 10);
+    eqint(strlen(text), mrb_print(b, "%s", text));
+    eqint(strlen(text), mrb_get(b, out, size));
+    eqnstr(text, out, strlen(text));
+
+    /* Compression, with both sides wrapping */
+    for (i = 0; i < 1000; i++) {
+        in[i] = "abcd"[i % 4];
+    }
+    nomirror_seek(b, size - 500);
+    nomirror_seek(c, size - 8);
+    nomirror_seek(d, size - 500);
+    eqint(1000, mrb_put(b, in, 1000));
+    eqint(1000, mrb_compress(c, b, 1000));
+    istrue(mrb_used(c) < 1000);
+    eqint(1000, mrb_decompress(d, c));
+    eqint(1000, mrb_get(d, out, size));
+    istrue(memcmp(in, out, 1000) == 0);
+
+    /* Datagrams, split over two iovecs where they wrap */
+    close(p[0]);
+    close(p[1]);
+    eqint(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, p));
+    nomirror_seek(b, size - 30);
+    nomirror_seek(c, size - 40);
+    eqint(0, mrb_recput(b, in, 20));
+    eqint(0, mrb_recput(b, in + 20, 20));
+    eqint(2, mrb_sendmmsg(b, p[0], 8));
+    eqint(2, mrb_recvmmsgex(c, p[1], 2, 64));
+    eqint(20, mrb_recget(c, out, size, NULL));
+    istrue(memcmp(in, out, 20) == 0);
+    eqint(20, mrb_recget(c, out, size, NULL));
+    istrue(memcmp(in + 20, out, 20) == 0);
+
+    close(p[0]);
+    close(p[1]);
+    close(ufd);
+    mrb_destroy(b);
+    mrb_destroy(c);
+    mrb_destroy(d);
+    mrb_destroy(m);
+}
+
+
+/* The lowest free file descriptor. */
+static int
+lowest_fd() {
+    int fd = dup(0);
+
+    close(fd);
+    return fd;
+}
+
+
+void
+test_mrb_init_failures() {
+    size_t size = mrb_calcsize(4);
+    struct rlimit saved;
+    struct rlimit limit;
+    char out[16];
+    int status;
+    pid_t pid;
+    mrb_t b;
+    int fd = lowest_fd();
+    int i;
+
+    /* Repeated create and destroy leaves no descriptor behind */
+    for (i = 0; i < 100; i++) {
+        b = mrb_createex(size, MRB_FILE);
+        isnotnull(b);
+        istrue(mrb_ismirrored(b));
+        eqint(0, mrb_destroy(b));
+    }
+    eqint(fd, lowest_fd());
+
+    /* No descriptor left for the memfd, falls back to a single mapping */
+    eqint(0, getrlimit(RLIMIT_NOFILE, &saved));
+    limit = saved;
+    limit.rlim_cur = fd;
+    eqint(0, setrlimit(RLIMIT_NOFILE, &limit));
+    b = mrb_createex(size, MRB_FILE);
+    eqint(0, setrlimit(RLIMIT_NOFILE, &saved));
+    isnotnull(b);
+    isfalse(mrb_ismirrored(b));
+    eqint(5, mrb_put(b, "hello", 5));
+    eqint(5, mrb_get(b, out, sizeof(out)));
+    eqnstr("hello", out, 5);
+    eqint(0, mrb_destroy(b));
+    eqint(fd, lowest_fd());
+
+    /* The memfd can not grow, it is closed on the way out */
+    signal(SIGXFSZ, SIG_IGN);
+    eqint(0, getrlimit(RLIMIT_FSIZE, &saved));
+    limit = saved;
+    limit.rlim_cur = size;
+    eqint(0, setrlimit(RLIMIT_FSIZE, &limit));
+    b = mrb_createex(size * 2, MRB_FILE);
+    eqint(0, setrlimit(RLIMIT_FSIZE, &saved));
+    signal(SIGXFSZ, SIG_DFL);
+    isnotnull(b);
+    isfalse(mrb_ismirrored(b));
+    eqint(0, mrb_destroy(b));
+    eqint(fd, lowest_fd());
+
+    /* Out of address space, neither mapping works and the error gets
+       through, in a child so the limit does not stick */
+    pid = fork();
+    if (pid == 0) {
+        limit.rlim_cur = 64 << 20;
+        limit.rlim_max = 64 << 20;
+        setrlimit(RLIMIT_AS, &limit);
+        b = mrb_create(mrb_calcsize(64 << 10));
+        _exit(((b == NULL) && (errno == ENOMEM))? 0: 1);
+    }
+    eqint(pid, waitpid(pid, &status, 0));
+    eqint(0, WEXITSTATUS(status));
+}
+
+
+void
+test_mrb_mirror_cache() {
+    size_t size = mrb_calcsize(4);
+    unsigned char vec[4];
+    unsigned char *buff;
+    char out[16];
+    int status;
+    int p[2];
+    pid_t pid;
+    mrb_t b;
+
+    /* The mirror of a destroyed buffer is reused, empty */
+    b = mrb_create(size);
+    buff = b->buff;
+    eqint(5, mrb_put(b, "hello", 5));
+    eqint(0, mrb_destroy(b));
+    b = mrb_create(size);
+    istrue(b->buff == buff);
+    istrue(mrb_isempty(b));
+    eqint(3, mrb_put(b, "foo", 3));
+    eqint(3, mrb_get(b, out, sizeof(out)));
+    eqnstr("foo", out, 3);
+
+    /* Not once the other process of a fork(2) might still use it */
+    eqint(0, pipe(p));
+    pid = fork();
+    if (pid == 0) {
+        read(p[0], out, 1);
+        mrb_put(b, "child", 5);
+        _exit(0);
+    }
+    eqint(0, mrb_destroy(b));
+    b = mrb_create(size);
+    eqint(1, write(p[1], "x", 1));
+    eqint(pid, waitpid(pid, &status, 0));
+    eqint(0, b->buff[3]);
+    eqint(0, mrb_destroy(b));
+    close(p[0]);
+    close(p[1]);
+
+    /* Nor its pages dropped, a large one keeps its data for the child */
+    b = mrb_create(mrb_calcsize(64));
+    eqint(5, mrb_put(b, "hello", 5));
+    eqint(0, pipe(p));
+    pid = fork();
+    if (pid == 0) {
+        read(p[0], out, 1);
+        _exit(memcmp(b->buff, "hello", 5)? 1: 0);
+    }
+    eqint(0, mrb_destroy(b));
+    eqint(1, write(p[1], "x", 1));
+    eqint(pid, waitpid(pid, &status, 0));
+    istrue(WIFEXITED(status));
+    eqint(0, WEXITSTATUS(status));
+    close(p[0]);
+    close(p[1]);
+
+    /* Nor with a backing file */
+    b = mrb_createex(size, MRB_FILE);
+    eqint(5, mrb_put(b, "hello", 5));
+    eqint(0, mrb_destroy(b));
+    b = mrb_createex(size, MRB_FILE);
+    eqint(0, b->buff[0]);
+    eqint(0, mrb_destroy(b));
+
+    /* Large ones without their pages */
+    b = mrb_create(mrb_calcsize(64));
+    buff = b->buff;
+    eqint(5, mrb_put(b, "hello", 5));
+    eqint(0, mrb_destroy(b));
+    b = mrb_create(mrb_calcsize(64));
+    istrue(b->buff == buff);
+    eqint(0, b->buff[0]);
+    eqint(0, b->buff[mrb_calcsize(64)]);
+    eqint(0, mrb_destroy(b));
+
+    /* Turned off, cached mirrors are unmapped at once */
+    eqint(-1, mrb_cache_limit(MRB_CACHE_MAX + 1));
+    eqint(EINVAL, errno);
+    errno = 0;
+    b = mrb_create(size);
+    buff = b->buff;
+    eqint(0, mrb_destroy(b));
+    eqint(0, mincore(buff, size, vec));
+    eqint(0, mrb_cache_limit(0));
+    eqint(-1, mincore(buff, size, vec));
+    eqint(ENOMEM, errno);
+    errno = 0;
+    b = mrb_create(size);
+    buff = b->buff;
+    eqint(0, mrb_destroy(b));
+    eqint(-1, mincore(buff, size, vec));
+    eqint(0, mrb_cache_limit(MRB_CACHE_MAX));
+}
+
+
+/* Number of mappings of the arena memfd in /proc/self/maps. */
+static int
+arena_mappings() {
+    FILE *maps = fopen("/proc/self/maps", "r");
+    char line[512];
+    int count = 0;
+
+    while (fgets(line, sizeof(line), maps)) {
+        if (strstr(line, "memfd:mrb-arena")) {
+            count++;
+        }
+    }
+    fclose(maps);
+    return count;
+}
+
+
+void
+test_mrb_arena() {
+    size_t pagesize = getpagesize();
+    mrb_arena_t a;
+    mrb_t rings[32];
+    unsigned char *buff;
+    char in[pagesize * 4];
+    char out[pagesize * 4];
+    size_t len;
+    int fd = lowest_fd();
+    int i;
+
+    a = mrb_arena_create(pagesize * 64);
+    isnotnull(a);
+    memset(in, 'a', sizeof(in));
+
+    /* Capacity is rounded up to a power of two pages */
+    rings[0] = mrb_arena_alloc(a, pagesize * 3);
+    isnotnull(rings[0]);
+    eqint(pagesize * 4, mrb_size(rings[0]));
+    istrue(mrb_ismirrored(rings[0]));
+
+    /* And the mirror works */
+    eqint(pagesize * 3, mrb_put(rings[0], in, pagesize * 3));
+    eqint(pagesize * 3, mrb_get(rings[0], out, pagesize * 3));
+    eqint(pagesize * 2, mrb_put(rings[0], in, pagesize * 2));
+    mrb_peek(rings[0], &len);
+    eqint(pagesize * 2, len);
+    eqint(pagesize * 2, mrb_get(rings[0], out, sizeof(out)));
+    istrue(memcmp(in, out, pagesize * 2) == 0);
+
+    /* A freed ring is reused by the next one of its size class */
+    buff = rings[0]->buff;
+    eqint(0, mrb_destroy(rings[0]));
+    rings[0] = mrb_arena_alloc(a, pagesize * 4);
+    istrue(rings[0]->buff == buff);
+    istrue(mrb_isempty(rings[0]));
+    eqint(0, mrb_destroy(rings[0]));
+
+    /* Many rings, one descriptor, neighbours share mappings */
+    for (i = 0; i < 32; i++) {
+        rings[i] = mrb_arena_alloc(a, pagesize);
+        isnotnull(rings[i]);
+        eqint(1, mrb_put(rings[i], in, 1));
+    }
+    eqint(fd + 1, lowest_fd());
+    istrue(arena_mappings() <= 34);
+
+    /* Exhausted */
+    isnull(mrb_arena_alloc(a, pagesize * 32));
+    eqint(ENOMEM, errno);
+    errno = 0;
+
+    for (i = 0; i < 32; i++) {
+        eqint(0, mrb_destroy(rings[i]));
+    }
+    eqint(0, mrb_arena_destroy(a));
+    eqint(fd, lowest_fd());
+    eqint(0, arena_mappings());
+}
+
+
+void
+test_mrb_small() {
+    mrb_t b = mrb_create_small(200);
+    const char *text = "0123456789abcdefghij";
+    char out[256];
+    size_t len;
+    int i;
+
+    isnull(mrb_create_small(1));
+    eqint(EINVAL, errno);
+    errno = 0;
+
+    isnotnull(b);
+    isfalse(mrb_ismirrored(b));
+    eqint(200, mrb_size(b));
+    eqint(199, mrb_available(b));
+
+    /* Plain data, wrapping a few times */
+    for (i = 0; i < 30; i++) {
+        eqint(0, mrb_putall(b, text, 20));
+        eqint(0, mrb_putall(b, text, 20));
+        eqint(40, mrb_get(b, out, sizeof(out)));
+        eqnstr(text, out, 20);
+        eqnstr(text, out + 20, 20);
+    }
+    eqint(-1, mrb_putall(b, out, 200));
+
+    /* Records and formatting across the end */
+    nomirror_seek(b, 190);
+    eqint(0, mrb_recput(b, text, 20));
+    eqint(20, mrb_recget(b, out, sizeof(out), NULL));
+    eqnstr(text, out, 20);
+    nomirror_seek(b, 195);
+    eqint(10, mrb_print(b, "%d", 1234567890));
+    mrb_peek(b, &len);
+    eqint(5, len);
+    eqint(10, mrb_get(b, out, sizeof(out)));
+    eqnstr("1234567890", out, 10);
+
+    /* Not aligned for O_DIRECT */
+    eqint(-1, mrb_writeout_direct(b, 1, 200));
+    eqint(EINVAL, errno);
+    errno = 0;
+
+    eqint(0, mrb_destroy(b));
+}
+
+
+static int watermark_calls;
+static bool watermark_above;
+
+
+static void
+watermark_cb(mrb_t b, bool above, void *arg) {
+    (void)b;
+    eqint(42, *(int *)arg);
+    watermark_calls++;
+    watermark_above = above;
+}
+
+
+void
+test_mrb_watermark() {
+    size_t size = mrb_calcsize(1);
+    mrb_t b = mrb_create(size);
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = 7};
+    char in[size];
+    char out[size];
+    int arg = 42;
+    int epfd;
+    int p[2];
+
+    memset(in, 'x', size);
+    eqint(-1, mrb_watermark(b, 100, 100, watermark_cb, &arg));
+    eqint(EINVAL, errno);
+    eqint(-1, mrb_watermark(b, size, 10, watermark_cb, &arg));
+    eqint(EINVAL, errno);
+    errno = 0;
+
+    /* One call per crossing, in both directions */
+    eqint(0, mrb_watermark(b, 1000, 200, watermark_cb, &arg));
+    eqint(0, watermark_calls);
+    eqint(999, mrb_put(b, in, 999));
+    eqint(0, watermark_calls);
+    eqint(500, mrb_put(b, in, 500));
+    eqint(1, watermark_calls);
+    istrue(watermark_above);
+    eqint(500, mrb_put(b, in, 500));
+    eqint(1000, mrb_get(b, out, 1000));
+    eqint(1, watermark_calls);
+    eqint(800, mrb_get(b, out, 800));
+    eqint(2, watermark_calls);
+    isfalse(watermark_above);
+    eqint(0, mrb_watermark(b, 0, 0, NULL, NULL));
+    eqint(1500, mrb_put(b, in, 1500));
+    eqint(2, watermark_calls);
+    eqint(1699, mrb_get(b, out, size));
+
+    /* Retained data counts, release brings the level down */
+    eqint(0, mrb_watermark(b, 1000, 200, watermark_cb, &arg));
+    mrb_retain(b, true);
+    eqint(1500, mrb_put(b, in, 1500));
+    eqint(1500, mrb_get(b, out, size));
+    eqint(3, watermark_calls);
+    eqint(0, mrb_release(b, mrb_seq_reader(b)));
+    eqint(4, watermark_calls);
+    mrb_retain(b, false);
+
+    /* Read interest follows the level */
+    eqint(0, socketpair(AF_UNIX, SOCK_STREAM, 0, p));
+    epfd = epoll_create1(0);
+    eqint(0, epoll_ctl(epfd, EPOLL_CTL_ADD, p[0], &event));
+    eqint(0, mrb_watermark_epoll(b, 1000, 200, epfd, p[0], &event));
+    eqint(size, write(p[1], in, size));
+    eqint(1, epoll_wait(epfd, &event, 1, 0));
+    eqint(7, event.data.u32);
+    eqint(1000, mrb_readin(b, p[0], 1000));
+    eqint(0, epoll_wait(epfd, &event, 1, 0));
+    eqint(900, mrb_get(b, out, 900));
+    eqint(1, epoll_wait(epfd, &event, 1, 0));
+    eqint(7, event.data.u32);
+
+    close(epfd);
+    close(p[0]);
+    close(p[1]);
+    eqint(0, mrb_destroy(b));
+}
+
+
+static int watermark_inside;
+static int watermark_misordered;
+
+
+static void
+watermark_order_cb(mrb_t b, bool above, void *arg) {
+    (void)b;
+    (void)arg;
+    if (__atomic_fetch_add(&watermark_inside, 1, __ATOMIC_ACQ_REL) ||
+            (above == watermark_above)) {
+        watermark_misordered++;
+    }
+    usleep(10);
+    watermark_above = above;
+    watermark_calls++;
+    __atomic_fetch_sub(&watermark_inside, 1, __ATOMIC_ACQ_REL);
+}
+
+
+static void *
+watermark_consumer(void *arg) {
+    mrb_t b = arg;
+    char out[64];
+    int i;
+
+    for (i = 0; i < 200000; i++) {
+        mrb_get(b, out, 1 + i % 64);
+    }
+    return NULL;
+}
+
+
+void
+test_mrb_watermark_threads() {
+    size_t size = mrb_calcsize(1);
+    mrb_t b = mrb_create(size);
+    char in[64];
+    pthread_t consumer;
+    size_t level;
+    int i;
+
+    /* Transitions from both sides never overlap and always alternate */
+    memset(in, 'x', sizeof(in));
+    watermark_calls = 0;
+    watermark_above = false;
+    eqint(0, mrb_watermark(b, 2000, 1000, watermark_order_cb, NULL));
+    eqint(0, pthread_create(&consumer, NULL, watermark_consumer, b));
+    for (i = 0; i < 200000; i++) {
+        mrb_put(b, in, 1 + i % 64);
+    }
+    eqint(0, pthread_join(consumer, NULL));
+    eqint(0, watermark_misordered);
+    istrue(watermark_calls > 0);
+
+    /* And the last one matches the buffer */
+    level = mrb_used(b);
+    if (level >= 2000) {
+        istrue(watermark_above);
+    }
+    else if (level <= 1000) {
+        isfalse(watermark_above);
+    }
+
+    eqint(0, mrb_destroy(b));
+}
+
+
+void
+test_mrb_log() {
+    size_t size = mrb_calcsize(1);
+    mrb_t b = mrb_create(size);
+    mrb_t c = mrb_createex(size, MRB_NOMIRROR);
+    char name[] = "mrb";
+    char out[256];
+    char expected[256];
+    uint64_t ts;
+    int i;
+
+    /* Formatted only when decoded, from the raw values */
+    eqint(0, MRB_LOG(b, "plain"));
+    eqint(0, MRB_LOG(b, "%d%% of %s, %-5s|", 42, name, "x"));
+    eqint(0, MRB_LOG(b, "%ld %lu %lld %llu %u", -1L, 2UL, -3LL, 4ULL, 5U));
+    eqint(0, MRB_LOG(b, "%.2f %c %p %s", 3.14159, 'z', (void *)b,
+                (char *)NULL));
+    strcpy(name, "xyz");
+    eqint(4, mrb_msg_count(b));
+
+    eqint(5, mrb_log_decode(b, out, sizeof(out), &ts));
+    eqstr("plain", out);
+    istrue(ts > 0);
+    eqint(18, mrb_log_decode(b, out, sizeof(out), NULL));
+    eqstr("42% of mrb, x    |", out);
+    eqint(11, mrb_log_decode(b, out, sizeof(out), NULL));
+    eqstr("-1 2 -3 4 5", out);
+    snprintf(expected, sizeof(expected), "%.2f %c %p %s", 3.14159, 'z',
+            (void *)b, "(null)");
+    eqint(strlen(expected), mrb_log_decode(b, out, sizeof(out), NULL));
+    eqstr(expected, out);
+    eqint(-1, mrb_log_decode(b, out, sizeof(out), NULL));
+    eqint(EAGAIN, errno);
+    errno = 0;
+
+    /* Too small for the text, the record stays */
+    eqint(0, MRB_LOG(b, "%s-%s", "abc", "def"));
+    eqint(-1, mrb_log_decode(b, out, 4, NULL));
+    eqint(EMSGSIZE, errno);
+    errno = 0;
+    eqstr("abc", out);
+    eqint(7, mrb_log_decode(b, out, sizeof(out), NULL));
+    eqstr("abc-def", out);
+
+    /* Missing or mismatched arguments and '*' are left as they are */
+    eqint(0, MRB_LOG(b, "%d %*d %s", 1, 2, 3));
+    eqint(8, mrb_log_decode(b, out, sizeof(out), NULL));
+    eqstr("1 %*d %s", out);
+    eqint(0, MRB_LOG(b, "%s %d %f", 5, "x", 1.5));
+    eqint(14, mrb_log_decode(b, out, sizeof(out), NULL));
+    eqstr("%s %d 1.500000", out);
+
+    /* Converted to what the length modifier expects */
+    eqint(0, MRB_LOG(b, "%ld|%Lf|%hhd|%zu|%jd", -1, 2.5, 300, 7U, -2));
+    eqint(19, mrb_log_decode(b, out, sizeof(out), NULL));
+    eqstr("-1|2.500000|44|7|-2", out);
+    eqint(0, MRB_LOG(b, "%lld %hu %lx", -3, 65537, 255U));
+    eqint(7, mrb_log_decode(b, out, sizeof(out), NULL));
+    eqstr("-3 1 ff", out);
+    eqint(0, MRB_LOG(b, "%ls %lc %Ld %hf %d", "w", 'c', 1, 1.5, 9));
+    eqint(17, mrb_log_decode(b, out, sizeof(out), NULL));
+    eqstr("%ls %lc %Ld %hf 9", out);
+
+    /* Other records are refused */
+    eqint(0, mrb_recput(b, "raw", 3));
+    eqint(-1, mrb_log_decode(b, out, sizeof(out), NULL));
+    eqint(EBADMSG, errno);
+    errno = 0;
+
+    /* Across the end of a buffer without the mirror */
+    for (i = 0; i < 200; i++) {
+        eqint(0, MRB_LOG(c, "%d: %s", i, "a string of some length"));
+        snprintf(expected, sizeof(expected), "%d: %s", i,
+                "a string of some length");
+        eqint(strlen(expected), mrb_log_decode(c, out, sizeof(out), NULL));
+        eqstr(expected, out);
+    }
+
+    eqint(0, mrb_destroy(b));
+    eqint(0, mrb_destroy(c));
+}
+
+
+void
+test_mrb_fopen() {
+    size_t size = mrb_calcsize(1);
+    mrb_t b = mrb_create(size);
+    char big[24001];
+    char line[64];
+    size_t len;
+    FILE *f;
+    FILE *r;
+
+    f = mrb_fopen(b, "w");
+    isnotnull(f);
+    r = mrb_fopen(b, "r");
+    isnotnull(r);
+
+    /* Each call lands in the buffer right away */
+    eqint(10, fprintf(f, "hello %s\n", "mrb"));
+    eqint(10, mrb_used(b));
+    eqint(1, fwrite("x\n", 2, 1, f));
+    eqint(12, mrb_used(b));
+    eqnstr("hello mrb\nx\n", mrb_peek(b, &len), 12);
+
+    /* Reading consumes, an empty buffer is end of file */
+    isnotnull(fgets(line, sizeof(line), r));
+    eqstr("hello mrb\n", line);
+    eqint(2, mrb_used(b));
+    eqint(2, fread(line, 1, sizeof(line), r));
+    istrue(feof(r));
+    isnull(fgets(line, sizeof(line), r));
+    clearerr(r);
+    eqint('y', fputc('y', f));
+    eqint('y', fgetc(r));
+    istrue(mrb_isempty(b));
+
+    /* Output that does not fit is not written at all */
+    while (mrb_available(b) > 16) {
+        mrb_put(b, "................", 16);
+    }
+    len = mrb_used(b);
+    eqint(-1, fprintf(f, "%s %d", "more than it takes", 12345));
+    istrue(ferror(f));
+    eqint(len, mrb_used(b));
+    clearerr(f);
+    eqint(0, fwrite(line, 16, 1, f));
+    eqint(len, mrb_used(b));
+    clearerr(f);
+    eqint(1, fwrite(line, 15, 1, f));
+    istrue(mrb_isfull(b));
+
+    /* The streams do not own the buffer */
+    eqint(0, fclose(f));
+    eqint(0, fclose(r));
+    istrue(mrb_isfull(b));
+    eqint(0, mrb_destroy(b));
+
+    /* Longer fprintf(3) output comes in pieces, a transaction keeps it
+       whole */
+    size = mrb_calcsize(4);
+    b = mrb_create(size);
+    f = mrb_fopen(b, "w");
+    memset(big, 'b', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    eqint(-1, fprintf(f, "%s", big));
+    istrue(mrb_used(b) > 0);
+    istrue(mrb_used(b) < (sizeof(big) - 1));
+    mrb_skip(b, mrb_used(b));
+    clearerr(f);
+    eqint(0, mrb_txbegin(b));
+    eqint(-1, fprintf(f, "%s", big));
+    eqint(0, mrb_txabort(b));
+    istrue(mrb_isempty(b));
+    clearerr(f);
+    eqint(0, mrb_txbegin(b));
+    eqint(12000, fprintf(f, "%s", big + sizeof(big) - 12001));
+    eqint(0, mrb_used(b));
+    eqint(0, mrb_txcommit(b));
+    eqint(12000, mrb_used(b));
+    eqint(0, fclose(f));
+    eqint(0, mrb_destroy(b));
+}
+
+
+void
+test_mrb_alloc() {
+    size_t size = mrb_calcsize(1);
+    mrb_t b = mrb_create(size);
+    mrb_t c = mrb_createex(size, MRB_NOMIRROR);
+    mrb_t d;
+    char *blocks[8];
+    char *p;
+    int i;
+
+    /* Bad alignments */
+    isnull(mrb_alloc(b, 16, 0));
+    eqint(EINVAL, errno);
+    isnull(mrb_alloc(b, 16, 24));
+    eqint(EINVAL, errno);
+    isnull(mrb_alloc(b, 16, size * 2));
+    eqint(EINVAL, errno);
+    eqint(-1, mrb_free_oldest(b));
+    eqint(ENOENT, errno);
+
+    /* Aligned, with room for the headers */
+    mrb_put(b, "x", 1);
+    mrb_skip(b, 1);
+    p = mrb_alloc(b, 100, 64);
+    isnotnull(p);
+    eqint(0, (uintptr_t)p % 64);
+    eqint(64 + 100 - 1, mrb_used(b));
+    memset(p, 'a', 100);
+    eqint(0, mrb_free_oldest(b));
+    istrue(mrb_isempty(b));
+
+    /* Released in order */
+    for (i = 0; i < 8; i++) {
+        blocks[i] = mrb_alloc(b, 200, 8);
+        isnotnull(blocks[i]);
+        eqint(0, (uintptr_t)blocks[i] % 8);
+        memset(blocks[i], '0' + i, 200);
+    }
+    for (i = 0; i < 8; i++) {
+        eqint('0' + i, blocks[i][0]);
+        eqint('0' + i, blocks[i][199]);
+        eqint(0, mrb_free_oldest(b));
+    }
+    istrue(mrb_isempty(b));
+
+    /* Released out of order, reused once the older ones are released */
+    for (i = 0; i < 3; i++) {
+        blocks[i] = mrb_alloc(b, 1300, 16);
+        isnotnull(blocks[i]);
+    }
+    isnull(mrb_alloc(b, 1300, 16));
+    eqint(ENOBUFS, errno);
+    mrb_free(b, blocks[1]);
+    mrb_free(b, blocks[2]);
+    isnull(mrb_alloc(b, 1300, 16));
+    mrb_free(b, blocks[0]);
+    istrue(mrb_isempty(b));
+
+    /* Never split at the end of the buffer */
+    for (i = 0; i < 20; i++) {
+        p = mrb_alloc(b, 700, 32);
+        isnotnull(p);
+        memset(p, 'm', 700);
+        mrb_free(b, p);
+        istrue(mrb_isempty(b));
+    }
+
+    /* Without the mirror, skipping the end of the buffer */
+    mrb_put(c, "x", 1);
+    mrb_skip(c, 1);
+    for (i = 0; i < 20; i++) {
+        blocks[0] = mrb_alloc(c, 700, 32);
+        isnotnull(blocks[0]);
+        istrue(blocks[0] >= (char *)c->buff);
+        istrue((blocks[0] + 700) <= (char *)c->buff + size);
+        eqint(0, (uintptr_t)blocks[0] % 32);
+        blocks[1] = mrb_alloc(c, 900, 8);
+        isnotnull(blocks[1]);
+        istrue((blocks[1] + 900) <= (char *)c->buff + size);
+        memset(blocks[0], 'n', 700);
+        memset(blocks[1], 'o', 900);
+        mrb_free(c, blocks[0]);
+        eqint('o', blocks[1][0]);
+        eqint(0, mrb_free_oldest(c));
+        istrue(mrb_isempty(c));
+    }
+
+    /* Small buffers start anywhere and wrap anywhere, the addresses are
+       aligned all the same */
+    d = mrb_create_small(1000);
+    for (i = 0; i < 50; i++) {
+        p = mrb_alloc(d, 16 + i * 7, (i % 2)? 64: 16);
+        isnotnull(p);
+        eqint(0, (uintptr_t)p % ((i % 2)? 64: 16));
+        istrue(p >= (char *)d->buff);
+        istrue((p + 16 + i * 7) <= (char *)d->buff + 1000);
+        memset(p, 's', 16 + i * 7);
+        mrb_free(d, p);
+        istrue(mrb_isempty(d));
+    }
+
+    eqint(0, mrb_destroy(b));
+    eqint(0, mrb_destroy(c));
+    eqint(0, mrb_destroy(d));
+}
+
+
 int main() {
     test_mrb_create_close();
     test_mrb_init_deinit();
@@ -314,5 +2234,31 @@ int main() {
     test_mrb_search();
     test_mrb_print();
     test_mrb_skip_rollback();
+    test_mrb_crc32c_hash();
+    test_mrb_compress_decompress();
+    test_mrb_records_evict();
+    test_mrb_index();
+    test_mrb_seq_retain_read_at();
+    test_mrb_rollback_retained();
+    test_mrb_reserve_commit_tx();
+    test_mrb_signalsafe_dump();
+    test_mrb_fork_shared();
+    test_mrb_fork_private();
+    test_mrb_writeout_direct();
+    test_mrb_sendout();
+    test_mrb_sendzc();
+    test_mrb_recvmmsg_sendmmsg();
+    test_mrb_recvts();
+    test_mrb_readin_adaptive();
+    test_mrb_nomirror();
+    test_mrb_init_failures();
+    test_mrb_mirror_cache();
+    test_mrb_arena();
+    test_mrb_small();
+    test_mrb_watermark();
+    test_mrb_watermark_threads();
+    test_mrb_log();
+    test_mrb_fopen();
+    test_mrb_alloc();
     return EXIT_SUCCESS;
 }